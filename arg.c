@@ -8,10 +8,11 @@
 
 #include "arg.h"
 
-int opt_arg_int;
-const char *opt_arg_string;
+/* Each thread parses its own argument vectors. */
+_Thread_local int opt_arg_int;
+_Thread_local const char *opt_arg_string;
 
-static int opt_index = 1;
+static _Thread_local int opt_index = 1;
 
 static int
 is_letter(char c)
@@ -21,13 +22,65 @@ is_letter(char c)
   return (u >= 'A' && u <= 'Z') || (u >= 'a' && u <= 'z');
 }
 
+/*
+ * Split line into arguments in place, starting at args[1] so the result can
+ * be given to next_opt. Double quotes group whitespace and a line starting
+ * with '#' has no arguments. args must have room for max_args + 1 pointers.
+ * Returns the argument count or -1 if a quote is left open or there are too
+ * many arguments.
+ */
 int
-next_opt(int argc, char **argv, const char *opt_string)
+split_args(char *line, char **args, int max_args)
+{
+  char *c, *arg;
+  int argc;
+  argc = 1;
+  c = line;
+  for (;;) {
+    while (*c == ' ' || *c == '\t' || *c == '\n' || *c == '\r')
+      c++;
+    if (*c == '\0' || (argc == 1 && *c == '#'))
+      break;
+    if (argc == max_args)
+      return -1;
+    if (*c == '"') {
+      arg = ++c;
+      while (*c && *c != '"')
+        c++;
+      if (*c == '\0')
+        return -1;
+    } else {
+      arg = c;
+      while (*c && *c != ' ' && *c != '\t' && *c != '\n' && *c != '\r')
+        c++;
+    }
+    args[argc++] = arg;
+    if (*c == '\0')
+      break;
+    *c++ = '\0';
+  }
+  args[argc] = NULL;
+  return argc;
+}
+
+/* Start parsing a new argument vector from its first argument. */
+void
+reset_opt(void)
+{
+  opt_index = 1;
+}
+
+/*
+ * Like next_opt but an invalid option is reported by returning '?' instead
+ * of exiting. Parsing of the vector stops after an invalid option.
+ */
+int
+try_next_opt(int argc, char **argv, const char *opt_string)
 {
   const char *opt;
   char *endptr;
 
-  if (opt_index == argc)
+  if (opt_index >= argc)
     return -1;
   if (argv[opt_index][0] != '-') {
     opt_arg_string = argv[opt_index];
@@ -42,7 +95,8 @@ next_opt(int argc, char **argv, const char *opt_string)
   }
   if (*opt_string == '\0') {
     fprintf(stderr, "Invalid option %s.\n", argv[opt_index]);
-    exit(1);
+    opt_index = argc;
+    return '?';
   }
   if (opt_string[1] == '\0' || is_letter(opt_string[1])) {
     opt_index += 1;
@@ -54,7 +108,8 @@ next_opt(int argc, char **argv, const char *opt_string)
     opt_arg_string = opt + 1;
   if (opt_arg_string == NULL || opt_arg_string[0] == '\0') {
     fprintf(stderr, "Option -%c needs argument.\n", *opt_string);
-    exit(1);
+    opt_index = argc;
+    return '?';
   }
   switch (opt_string[1]) {
   case '*':
@@ -64,7 +119,8 @@ next_opt(int argc, char **argv, const char *opt_string)
     opt_arg_int = strtol(opt_arg_string, &endptr, 10);
     if (*endptr != '\0') {
       fprintf(stderr, "Option -%c expects integer argument.\n", *opt_string);
-      exit(1);
+      opt_index = argc;
+      return '?';
     }
     break;
   default:
@@ -74,3 +130,12 @@ next_opt(int argc, char **argv, const char *opt_string)
   opt_index++;
   return *opt_string;
 }
+
+int
+next_opt(int argc, char **argv, const char *opt_string)
+{
+  int c;
+  if ( (c = try_next_opt(argc, argv, opt_string)) == '?')
+    exit(1);
+  return c;
+}
@@ -3,7 +3,10 @@
  * See LICENSE for license details.
  */
 
-extern int opt_arg_int;
-extern const char *opt_arg_string;
+extern _Thread_local int opt_arg_int;
+extern _Thread_local const char *opt_arg_string;
 
+int split_args(char *line, char **args, int max_args);
+void reset_opt(void);
+int try_next_opt(int argc, char **argv, const char *opt_string);
 int next_opt(int argc, char **argv, const char *opt_string);
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2023 Christopher Lang
+ * See LICENSE for license details.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "sha256.h"
+#include "cache.h"
+
+/*
+ * Bump on every change to the bytes written for the same input and options,
+ * so that entries made before it are missed rather than served stale.
+ */
+#define FORMAT_REVISION 2
+
+/* Read all of file, which the key is a hash of before any of it is used. */
+char *
+cache_read_input(FILE *file, long *length)
+{
+  char *bytes;
+  long allocated;
+  size_t n;
+  allocated = 65536;
+  bytes = xmalloc(allocated);
+  *length = 0;
+  while ( (n = fread(bytes + *length, 1, allocated - *length, file)) ) {
+    *length += n;
+    if (*length == allocated) {
+      allocated *= 2;
+      bytes = xrealloc(bytes, allocated);
+    }
+  }
+  if (ferror(file)) {
+    fprintf(stderr, "Error reading input.\n");
+    exit(1);
+  }
+  return bytes;
+}
+
+void
+cache_init(struct cache *cache, const char *dir)
+{
+  if (mkdir(dir, 0777) && errno != EEXIST) {
+    fprintf(stderr, "Failed to create cache directory %s.\n", dir);
+    exit(1);
+  }
+  cache->dir = dir;
+  sha256_init(&cache->sha);
+  cache->entry_fname = cache->tmp_fname = NULL;
+  cache_add_int(cache, FORMAT_REVISION);
+}
+
+void
+cache_free(struct cache *cache)
+{
+  free(cache->entry_fname);
+  free(cache->tmp_fname);
+}
+
+void
+cache_add(struct cache *cache, const void *bytes, long length)
+{
+  sha256_update(&cache->sha, bytes, length);
+}
+
+void
+cache_add_int(struct cache *cache, long n)
+{
+  char digits[24];
+  cache_add(cache, digits, sprintf(digits, "%ld;", n));
+}
+
+/* Strings are prefixed by their length so that no two lists hash alike. */
+void
+cache_add_string(struct cache *cache, const char *string)
+{
+  cache_add_int(cache, strlen(string));
+  cache_add(cache, string, strlen(string));
+}
+
+/*
+ * Add a file by its contents rather than its status, so fresh copies of the
+ * same files, such as in a new checkout, still find their entries.
+ */
+void
+cache_add_file(struct cache *cache, const char *fname)
+{
+  FILE *file;
+  char *bytes;
+  long length;
+  cache_add_string(cache, fname);
+  if ( (file = fopen(fname, "r")) == NULL) {
+    /* Making the PDF will report it. */
+    cache_add_int(cache, -1);
+    return;
+  }
+  bytes = cache_read_input(file, &length);
+  fclose(file);
+  cache_add_int(cache, length);
+  cache_add(cache, bytes, length);
+  free(bytes);
+}
+
+/* Finish the key. Returns 1 if its entry exists. */
+int
+cache_lookup(struct cache *cache)
+{
+  unsigned char digest[32];
+  int i, n;
+  sha256_final(&cache->sha, digest);
+  cache->entry_fname = xmalloc(strlen(cache->dir) + 70);
+  n = sprintf(cache->entry_fname, "%s/", cache->dir);
+  for (i = 0; i < 32; i++)
+    n += sprintf(cache->entry_fname + n, "%02x", digest[i]);
+  strcpy(cache->entry_fname + n, ".pdf");
+  return access(cache->entry_fname, R_OK) == 0;
+}
+
+/* Returns the file to write the new entry to. */
+const char *
+cache_begin_store(struct cache *cache)
+{
+  cache->tmp_fname = xmalloc(strlen(cache->entry_fname) + 24);
+  sprintf(cache->tmp_fname, "%s.%ld.tmp", cache->entry_fname, (long)getpid());
+  return cache->tmp_fname;
+}
+
+void
+cache_end_store(struct cache *cache)
+{
+  if (rename(cache->tmp_fname, cache->entry_fname)) {
+    fprintf(stderr, "Failed to add %s to the cache.\n", cache->entry_fname);
+    unlink(cache->tmp_fname);
+    exit(1);
+  }
+}
+
+/*
+ * Copy the entry to fname, or standard output for "-". It isn't hard linked,
+ * as writing a PDF over the output would then change the entry too.
+ */
+void
+cache_copy(struct cache *cache, const char *fname)
+{
+  FILE *in, *out;
+  char buffer[65536];
+  size_t n;
+  if ( (in = fopen(cache->entry_fname, "r")) == NULL) {
+    fprintf(stderr, "Failed to open cache entry %s.\n", cache->entry_fname);
+    exit(1);
+  }
+  out = strcmp(fname, "-") == 0 ? stdout : fopen(fname, "w");
+  if (out == NULL) {
+    fprintf(stderr, "Failed to open file %s.\n", fname);
+    exit(1);
+  }
+  while ( (n = fread(buffer, 1, sizeof(buffer), in)) )
+    fwrite(buffer, 1, n, out);
+  if (ferror(in) || fflush(out) || ferror(out)) {
+    fprintf(stderr, "Error copying cache entry to %s.\n", fname);
+    exit(1);
+  }
+  fclose(in);
+  if (out != stdout)
+    fclose(out);
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2023 Christopher Lang
+ * See LICENSE for license details.
+ */
+
+/*
+ * The following must be included before this file:
+#include <stdint.h>
+#include <stdio.h>
+#include "sha256.h"
+ */
+
+/*
+ * A directory of finished PDFs, each named by the hash of everything that
+ * went into making it. Entries are written to a temporary name and renamed
+ * into place, so processes can share a directory.
+ */
+struct cache {
+  const char *dir;
+  struct sha256 sha;
+  char *entry_fname, *tmp_fname;
+};
+
+char *cache_read_input(FILE *file, long *length);
+void cache_init(struct cache *cache, const char *dir);
+void cache_free(struct cache *cache);
+void cache_add(struct cache *cache, const void *bytes, long length);
+void cache_add_int(struct cache *cache, long n);
+void cache_add_string(struct cache *cache, const char *string);
+void cache_add_file(struct cache *cache, const char *fname);
+int cache_lookup(struct cache *cache);
+const char *cache_begin_store(struct cache *cache);
+void cache_end_store(struct cache *cache);
+void cache_copy(struct cache *cache, const char *fname);
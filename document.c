@@ -3,52 +3,244 @@
  * See LICENSE for license details.
  */
 
+#include <pthread.h>
+#include <setjmp.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "utils.h"
+#include "typewriter.h"
+#include "twerror.h"
 #include "twpdf.h"
 #include "twcontent.h"
 #include "twjpeg.h"
 #include "twpages.h"
 #include "document.h"
 
-static void relax_glue(struct gizmo_glue *start, struct gizmo_glue *sentinel, int max_height);
+/*
+ * Lines at least this long that are built this many times are shown through
+ * a form XObject, so their text is written once. Shorter lines cost less
+ * inline than the operators that place a form.
+ */
+#define TEXT_FORM_MIN_LENGTH 48
+#define TEXT_FORM_MIN_COUNT 4
+
+/* A distinct line of text, counted before its pages are built. */
+struct text_form {
+  unsigned long hash;
+  const char *str;
+  int length, font_size;
+  int count;
+  struct pdf_obj_indirect *ref;         /* Once defined. */
+  const char *name;                     /* Kept by the pdf. */
+};
+
+/* Formats the content streams and page tree while pages are added. */
+struct page_builder {
+  struct document *doc;
+  struct pdf *pdf;
+  struct pdf_pages pages;
+  struct pdf_content content;
+  struct pdf_obj_dictionary *xobjects;
+  struct pdf_obj_indirect *catalogue_ref;
+  /* Open addressed by hash, with a power of two slots. */
+  struct text_form *forms;
+  int form_allocated, form_count;
+  struct pdf_obj_indirect *form_resources;
+};
+
+static void add_source(struct layout *layout, struct gizmo_glue *glue);
+static void mark_optimal(struct layout *layout, struct gizmo_glue *last);
+static struct gizmo_glue *common_source(struct gizmo_glue *a,
+    struct gizmo_glue *b);
+static struct gizmo_glue *best_end(struct layout *layout,
+    int *best_total_penalty);
+static int fixed_pitch_breaks(struct document *doc);
+static void add_page(struct page_builder *builder);
+static struct pdf_obj_dictionary *define_image(struct document *doc,
+    struct pdf *pdf, struct pdf_obj_dictionary *xobjects, const char *name);
+static unsigned long hash_text(const struct gizmo_text *text);
+static struct text_form *find_form(struct page_builder *builder,
+    const struct gizmo_text *text, unsigned long hash);
+static void count_forms(struct page_builder *builder, struct gizmo *begin,
+    struct gizmo *end);
+static struct text_form *use_form(struct page_builder *builder,
+    const struct gizmo_text *text);
 
 static void
-relax_glue(struct gizmo_glue *start, struct gizmo_glue *sentinel, int max_height)
+add_source(struct layout *layout, struct gizmo_glue *glue)
+{
+  int count;
+  if (layout->source_end == layout->source_allocated) {
+    count = layout->source_end - layout->last_begin;
+    if (count * 2 > layout->source_allocated) {
+      layout->source_allocated *= 2;
+      layout->sources = xrealloc(layout->sources,
+          layout->source_allocated * sizeof(struct layout_source));
+    }
+    memmove(layout->sources, layout->sources + layout->last_begin,
+        count * sizeof(struct layout_source));
+    layout->source_begin -= layout->last_begin;
+    layout->last_begin = 0;
+    layout->source_end = count;
+  }
+  layout->sources[layout->source_end].glue = glue;
+  layout->sources[layout->source_end++].height = layout->height
+    + glue->no_break_height;
+}
+
+static void
+mark_optimal(struct layout *layout, struct gizmo_glue *last)
 {
-  int used_height, total_penalty, stop;
-  used_height = 0;
-  stop = 0;
-  struct gizmo *gizmo;
   struct gizmo_glue *glue;
-  for (gizmo = start->next; !stop && gizmo != (struct gizmo *)sentinel; gizmo = gizmo->next) {
-    if (gizmo->type == GIZMO_GLUE) {
-      glue = (struct gizmo_glue *)gizmo;
-      total_penalty = start->best_total_penalty + start->break_penalty;
-      if (used_height > max_height) {
-        total_penalty += 10000;
-        stop = 1;
-      } else {
-        total_penalty += max_height - used_height;
-      }
-      if (glue->best_source == NULL || glue->best_total_penalty > total_penalty) {
-        glue->best_source = start;
-        glue->best_total_penalty = total_penalty;
+  for (glue = last; glue != layout->committed; glue = glue->best_source)
+    glue->is_optimal = 1;
+  layout->committed = last;
+}
+
+static struct gizmo_glue *
+common_source(struct gizmo_glue *a, struct gizmo_glue *b)
+{
+  while (a->depth > b->depth)
+    a = a->best_source;
+  while (b->depth > a->depth)
+    b = b->best_source;
+  while (a != b) {
+    a = a->best_source;
+    b = b->best_source;
+  }
+  return a;
+}
+
+/* Define the image name in pdf unless xobjects already has it. */
+static struct pdf_obj_dictionary *
+define_image(struct document *doc, struct pdf *pdf,
+    struct pdf_obj_dictionary *xobjects, const char *name)
+{
+  struct pdf_obj_dictionary *entry;
+  struct pdf_obj_indirect *ref;
+  struct pdf_jpeg_info info;
+  for (entry = xobjects; entry->key; entry = entry->tail)
+    if (strcmp(entry->key->string, name) == 0)
+      return xobjects;
+  if (doc->jpeg_cache)
+    ref = pdf_jpeg_cache_define(doc->jpeg_cache, pdf, name, &info);
+  else
+    ref = pdf_jpeg_define(pdf, name, &info);
+  return pdf_prepend_dictionary(pdf, xobjects, name, (struct pdf_obj *)ref);
+}
+
+/* FNV-1a of the text and its size. */
+static unsigned long
+hash_text(const struct gizmo_text *text)
+{
+  unsigned long hash;
+  int i;
+  hash = 2166136261u ^ (unsigned long)text->font_size;
+  for (i = 0; i < text->length; i++)
+    hash = (hash ^ (unsigned char)text->str[i]) * 16777619u;
+  return hash;
+}
+
+/* The slot holding text, or the empty slot where it belongs. */
+static struct text_form *
+find_form(struct page_builder *builder, const struct gizmo_text *text,
+    unsigned long hash)
+{
+  struct text_form *form;
+  int mask, i;
+  mask = builder->form_allocated - 1;
+  for (i = hash & mask; ; i = (i + 1) & mask) {
+    form = &builder->forms[i];
+    if (form->str == NULL
+        || (form->hash == hash && form->length == text->length
+          && form->font_size == text->font_size
+          && memcmp(form->str, text->str, text->length) == 0))
+      return form;
+  }
+}
+
+/* Count the long lines from begin up to end, adding to earlier ranges. */
+static void
+count_forms(struct page_builder *builder, struct gizmo *begin,
+    struct gizmo *end)
+{
+  struct text_form *old_forms, *form;
+  struct gizmo_text *text;
+  struct gizmo *gizmo;
+  unsigned long hash;
+  int i, j, mask, old_allocated;
+  for (gizmo = begin; gizmo != end; gizmo = gizmo->next) {
+    if (gizmo->type != GIZMO_TEXT)
+      continue;
+    text = (struct gizmo_text *)gizmo;
+    if (text->length < TEXT_FORM_MIN_LENGTH)
+      continue;
+    if (builder->form_count * 2 >= builder->form_allocated) {
+      old_forms = builder->forms;
+      old_allocated = builder->form_allocated;
+      builder->form_allocated = old_allocated ? old_allocated * 2 : 64;
+      builder->forms = xmalloc(builder->form_allocated
+          * sizeof(struct text_form));
+      memset(builder->forms, 0,
+          builder->form_allocated * sizeof(struct text_form));
+      mask = builder->form_allocated - 1;
+      for (i = 0; i < old_allocated; i++) {
+        if (old_forms[i].str == NULL)
+          continue;
+        for (j = old_forms[i].hash & mask; builder->forms[j].str;
+            j = (j + 1) & mask)
+          ;
+        builder->forms[j] = old_forms[i];
       }
+      free(old_forms);
     }
-    used_height += gizmo_height(gizmo);
-  }
-  if (gizmo == (struct gizmo *)sentinel) {
-    total_penalty = start->best_total_penalty + start->break_penalty;
-    if (used_height > max_height)
-      total_penalty += 10000;
-    if (sentinel->best_source == NULL || sentinel->best_total_penalty > total_penalty) {
-      sentinel->best_source = start;
-      sentinel->best_total_penalty = total_penalty;
+    hash = hash_text(text);
+    form = find_form(builder, text, hash);
+    if (form->str == NULL) {
+      form->hash = hash;
+      form->str = text->str;
+      form->length = text->length;
+      form->font_size = text->font_size;
+      builder->form_count++;
     }
+    form->count++;
+  }
+}
+
+/*
+ * The form to show text through, defined on first use, or NULL if text is
+ * better written inline. Form names end in '/', which no JPEG file name can,
+ * so they never clash with the names of images.
+ */
+static struct text_form *
+use_form(struct page_builder *builder, const struct gizmo_text *text)
+{
+  struct text_form *form;
+  struct pdf *pdf;
+  char name[16];
+  if (text->length < TEXT_FORM_MIN_LENGTH)
+    return NULL;
+  form = find_form(builder, text, hash_text(text));
+  if (form->count < TEXT_FORM_MIN_COUNT)
+    return NULL;
+  if (form->ref)
+    return form;
+  pdf = builder->pdf;
+  if (builder->form_resources == NULL) {
+    builder->form_resources = pdf_allocate_indirect_obj(pdf);
+    pdf_define_obj(pdf, builder->form_resources,
+        pdf_content_create_form_resources(pdf), 0);
   }
+  form->ref = pdf_allocate_indirect_obj(pdf);
+  pdf_content_define_text_form(pdf, form->ref, builder->form_resources,
+      text->str, text->length, text->font_size);
+  snprintf(name, sizeof(name), "T%d/", form->ref->obj_num);
+  form->name = pdf_create_name_copy(pdf, name)->string;
+  builder->xobjects = pdf_prepend_dictionary(pdf, builder->xobjects,
+      form->name, (struct pdf_obj *)form->ref);
+  return form;
 }
 
 int
@@ -68,40 +260,238 @@ gizmo_height(const struct gizmo *gizmo)
     glue = (struct gizmo_glue *)gizmo;
     return glue->no_break_height;
   }
-  fprintf(stderr, "tw: Unknown gizmo type %d.\n", gizmo->type);
-  exit(1);
+  tw_fail(TW_ERR_INVALID, "tw: Unknown gizmo type %d.", gizmo->type);
+}
+
+
+void
+layout_init(struct layout *layout, struct document *doc)
+{
+  struct gizmo_glue *start;
+  layout->max_height = 842 - doc->top_margin - doc->bot_margin;
+  layout->height = 0;
+  start = &layout->start;
+  start->type = GIZMO_GLUE;
+  start->next = NULL;
+  start->break_penalty = 0;
+  start->no_break_height = 0;
+  start->best_source = NULL;
+  start->best_total_penalty = 0;
+  start->depth = 0;
+  start->is_optimal = 0;
+  layout->source_allocated = 256;
+  layout->sources = xmalloc(layout->source_allocated
+      * sizeof(struct layout_source));
+  layout->source_begin = layout->last_begin = layout->source_end = 0;
+  add_source(layout, start);
+  layout->committed = start;
+}
+
+void
+layout_free(struct layout *layout)
+{
+  free(layout->sources);
+}
+
+/*
+ * A glue's best path is relaxed from every source that can reach it, from the
+ * oldest. A source stops at the first glue it overfills the page for, and as
+ * older sources have more height after them they always stop first. The
+ * newest of equally good sources wins, so that tied paths, such as those
+ * through lines of one height, share their earlier breaks and can be
+ * committed before the input ends.
+ */
+void
+layout_push(struct layout *layout, struct gizmo *gizmo)
+{
+  struct gizmo_glue *glue, *source;
+  long used_height;
+  int i, total_penalty;
+  layout->last_begin = layout->source_begin;
+  if (gizmo->type == GIZMO_GLUE) {
+    glue = (struct gizmo_glue *)gizmo;
+    glue->best_source = NULL;
+    for (i = layout->source_begin; i < layout->source_end; i++) {
+      source = layout->sources[i].glue;
+      used_height = layout->height - layout->sources[i].height;
+      total_penalty = source->best_total_penalty + source->break_penalty;
+      if (used_height > layout->max_height) {
+        total_penalty += 10000;
+        layout->source_begin = i + 1;
+      } else {
+        total_penalty += layout->max_height - used_height;
+      }
+      if (glue->best_source == NULL || glue->best_total_penalty >= total_penalty) {
+        glue->best_source = source;
+        glue->best_total_penalty = total_penalty;
+      }
+    }
+    glue->depth = glue->best_source->depth + 1;
+    add_source(layout, glue);
+  }
+  layout->height += gizmo_height(gizmo);
+}
+
+/*
+ * Mark the breaks that the best path to every possible source goes through
+ * as optimal. Returns the last of them, or NULL if there are no new ones.
+ * Sources that stopped at the last gizmo can still end the document.
+ */
+struct gizmo_glue *
+layout_commit(struct layout *layout)
+{
+  struct gizmo_glue *common, *join;
+  int i;
+  /*
+   * Each join lies on the path to the source before it, as does the common
+   * break so far, so the shallower of the two is common to both. Neighbouring
+   * paths meet soon, however far back every path meets.
+   */
+  common = layout->sources[layout->last_begin].glue;
+  for (i = layout->last_begin + 1;
+      i < layout->source_end && common != layout->committed; i++) {
+    join = common_source(layout->sources[i - 1].glue,
+        layout->sources[i].glue);
+    if (join->depth < common->depth)
+      common = join;
+  }
+  if (common == layout->committed)
+    return NULL;
+  mark_optimal(layout, common);
+  return common;
+}
+
+/* The source the best path to the end of the document breaks at last. */
+static struct gizmo_glue *
+best_end(struct layout *layout, int *best_total_penalty)
+{
+  struct gizmo_glue *source, *best;
+  long used_height;
+  int i, total_penalty;
+  best = NULL;
+  *best_total_penalty = 0;
+  for (i = layout->last_begin; i < layout->source_end; i++) {
+    source = layout->sources[i].glue;
+    used_height = layout->height - layout->sources[i].height;
+    total_penalty = source->best_total_penalty + source->break_penalty;
+    if (used_height > layout->max_height)
+      total_penalty += 10000;
+    if (best == NULL || *best_total_penalty > total_penalty) {
+      best = source;
+      *best_total_penalty = total_penalty;
+    }
+  }
+  return best;
+}
+
+/*
+ * Commit the first break on the path that would be best if the input ended
+ * here, when there is no room to look further ahead. Returns NULL if the path
+ * has no breaks.
+ */
+struct gizmo_glue *
+layout_force(struct layout *layout)
+{
+  struct gizmo_glue *glue;
+  int total_penalty;
+  glue = best_end(layout, &total_penalty);
+  if (glue == layout->committed)
+    return NULL;
+  while (glue->best_source != layout->committed)
+    glue = glue->best_source;
+  mark_optimal(layout, glue);
+  return glue;
 }
 
+/*
+ * End the document, marking the rest of the best path as optimal. Returns its
+ * total penalty.
+ */
+int
+layout_finish(struct layout *layout)
+{
+  int total_penalty;
+  mark_optimal(layout, best_end(layout, &total_penalty));
+  return total_penalty;
+}
+
+/*
+ * Mark the breaks of a document of equally tall lines, each followed by the
+ * same glue, without searching, as tw-raw makes them. With lines_per_page
+ * the most that fit, the best path to every glue runs through the full pages
+ * before it, the newest of the equally good sources. The document ends best
+ * after the last full page that leaves a line over, so every page but the
+ * last is full. Returns 0 if the document is not like this.
+ */
+static int
+fixed_pitch_breaks(struct document *doc)
+{
+  struct gizmo *gizmo;
+  struct gizmo_glue *glue;
+  int font_size, break_penalty, max_height;
+  long line, line_count, lines_per_page, last_break;
+  gizmo = doc->gizmos;
+  if (gizmo == NULL || gizmo->type != GIZMO_TEXT || gizmo->next == NULL
+      || gizmo->next->type != GIZMO_GLUE)
+    return 0;
+  font_size = ((struct gizmo_text *)gizmo)->font_size;
+  break_penalty = ((struct gizmo_glue *)gizmo->next)->break_penalty;
+  max_height = 842 - doc->top_margin - doc->bot_margin;
+  /* Negative penalties could make more pages worth it. */
+  if (font_size <= 0 || font_size > max_height || break_penalty < 0)
+    return 0;
+  line_count = 0;
+  for (gizmo = doc->gizmos; gizmo; gizmo = glue->next) {
+    if (gizmo->type != GIZMO_TEXT
+        || ((struct gizmo_text *)gizmo)->font_size != font_size
+        || gizmo->next == NULL || gizmo->next->type != GIZMO_GLUE)
+      return 0;
+    glue = (struct gizmo_glue *)gizmo->next;
+    if (glue->break_penalty != break_penalty || glue->no_break_height != 0)
+      return 0;
+    line_count++;
+  }
+  lines_per_page = max_height / font_size;
+  last_break = (line_count - 1) / lines_per_page * lines_per_page;
+  line = 0;
+  for (gizmo = doc->gizmos; line < last_break; gizmo = glue->next) {
+    glue = (struct gizmo_glue *)gizmo->next;
+    if (++line % lines_per_page == 0)
+      glue->is_optimal = 1;
+  }
+  return 1;
+}
 
 void
 optimise_breaks(struct document *doc)
 {
+  struct layout layout;
   struct gizmo *gizmo;
-  struct gizmo_glue start_gizmo, *sentinel_gizmo, *glue;
-  sentinel_gizmo = xmalloc(sizeof(struct gizmo_glue));
-  sentinel_gizmo->type = GIZMO_GLUE;
-  sentinel_gizmo->next = NULL;
-  sentinel_gizmo->break_penalty = 0;
-  sentinel_gizmo->no_break_height = 0;
-  sentinel_gizmo->best_source = NULL;
-  sentinel_gizmo->best_total_penalty = 0;
-  sentinel_gizmo->is_optimal = 0;
-  *doc->gizmos_end = (struct gizmo *)sentinel_gizmo;
-  start_gizmo.type = GIZMO_GLUE;
-  start_gizmo.next = doc->gizmos;
-  start_gizmo.break_penalty = 0;
-  start_gizmo.no_break_height = 0;
-  start_gizmo.best_source = NULL;
-  start_gizmo.best_total_penalty = 0;
-  start_gizmo.is_optimal = 0;
-  relax_glue(&start_gizmo, sentinel_gizmo, 842 - doc->top_margin - doc->bot_margin);
-  for (gizmo = doc->gizmos; gizmo != (struct gizmo *)sentinel_gizmo; gizmo = gizmo->next)
-    if (gizmo->type == GIZMO_GLUE)
-      relax_glue((struct gizmo_glue *)gizmo, sentinel_gizmo, 842 - doc->top_margin - doc->bot_margin);
-  for (glue = sentinel_gizmo; glue != &start_gizmo; glue = glue->best_source)
-    glue->is_optimal = 1;
-  *doc->gizmos_end = NULL;
-  free(sentinel_gizmo);
+  if (fixed_pitch_breaks(doc))
+    return;
+  layout_init(&layout, doc);
+  for (gizmo = doc->gizmos; gizmo; gizmo = gizmo->next)
+    layout_push(&layout, gizmo);
+  layout_finish(&layout);
+  layout_free(&layout);
+}
+
+/*
+ * The total penalty of the optimal breaks, which are not marked. Any marks
+ * already made are kept.
+ */
+int
+optimal_penalty(struct document *doc)
+{
+  struct layout layout;
+  struct gizmo *gizmo;
+  int total_penalty;
+  layout_init(&layout, doc);
+  for (gizmo = doc->gizmos; gizmo; gizmo = gizmo->next)
+    layout_push(&layout, gizmo);
+  best_end(&layout, &total_penalty);
+  layout_free(&layout);
+  return total_penalty;
 }
 
 void
@@ -111,9 +501,9 @@ init_document(struct document *doc, int top_margin, int bot_margin, int left_mar
   doc->top_margin = top_margin;
   doc->bot_margin = bot_margin;
   doc->left_margin = left_margin;
-  doc->xobjects = pdf_create_dictionary(&doc->pdf);
   doc->gizmos = NULL;
   doc->gizmos_end = &doc->gizmos;
+  doc->jpeg_cache = NULL;
 }
 
 void
@@ -130,59 +520,197 @@ free_document(struct document *doc)
 void
 build_document(struct document *doc)
 {
-  struct pdf_pages pages;
-  struct pdf_content content;
-  struct pdf_obj_indirect *content_ref, *catalogue_ref;
-  struct pdf_obj *resources;
+  build_pages(doc, &doc->pdf, doc->gizmos, NULL);
+}
+
+/*
+ * Build the document and write it to fname, "-" for standard output, each
+ * object as soon as it is defined. The pages are never all held in memory at
+ * once, unlike with build_document and pdf_write, but the pdf can't be
+ * linearized or appended to a base file.
+ */
+void
+write_document(struct document *doc, const char *fname)
+{
+  struct pdf_output out;
+  struct tw_trap trap;
+  FILE *volatile file;
+  file = strcmp(fname, "-") == 0 ? stdout : fopen(fname, "w");
+  if (file == NULL)
+    tw_fail(TW_ERR_IO, "tw: Failed to open file %s.", fname);
+  tw_push_trap(&trap);
+  if (setjmp(trap.env)) {
+    if (file != stdout)
+      fclose(file);
+    tw_rethrow(&trap);
+  }
+  pdf_output_begin(&out, file);
+  pdf_output_immediate(&out, &doc->pdf);
+  build_document(doc);
+  pdf_output_end(&out, &doc->pdf);
+  if (fflush(file) || ferror(file))
+    tw_fail(TW_ERR_IO, "tw: Error writing file %s.", fname);
+  tw_pop_trap(&trap);
+  if (file != stdout)
+    fclose(file);
+}
+
+/*
+ * Build the pages of the gizmos from begin up to end into pdf. end must be
+ * NULL or an optimal break.
+ */
+void
+build_pages(struct document *doc, struct pdf *pdf, struct gizmo *begin,
+    struct gizmo *end)
+{
+  struct page_builder *builder;
+  builder = begin_pages(doc, pdf);
+  build_page_range(builder, begin, end);
+  end_pages(builder);
+}
+
+struct page_builder *
+begin_pages(struct document *doc, struct pdf *pdf)
+{
+  struct page_builder *builder;
+  builder = xmalloc(sizeof(struct page_builder));
+  builder->doc = doc;
+  builder->pdf = pdf;
+  /* An update to a base file keeps its catalogue. */
+  builder->catalogue_ref = pdf->base ? NULL : pdf_allocate_indirect_obj(pdf);
+  pdf_pages_init(pdf, &builder->pages);
+  pdf_content_init(&builder->content);
+  builder->xobjects = pdf_create_dictionary(pdf);
+  builder->forms = NULL;
+  builder->form_allocated = 0;
+  builder->form_count = 0;
+  builder->form_resources = NULL;
+  return builder;
+}
+
+static void
+add_page(struct page_builder *builder)
+{
+  struct pdf_obj_indirect *content_ref;
+  content_ref = pdf_allocate_indirect_obj(builder->pdf);
+  pdf_content_define(builder->pdf, content_ref, &builder->content);
+  pdf_pages_add_page(builder->pdf, &builder->pages, content_ref);
+  pdf_content_reset_page(&builder->content);
+}
+
+/*
+ * Add the pages of the gizmos from begin up to end, which must be NULL or an
+ * optimal break. The last page ends at end.
+ */
+void
+build_page_range(struct page_builder *builder, struct gizmo *begin,
+    struct gizmo *end)
+{
+  struct document *doc;
   struct gizmo *gizmo;
   struct gizmo_text *text;
   struct gizmo_image *image;
   struct gizmo_glue *glue;
+  struct text_form *form;
   int height;
-  catalogue_ref = pdf_allocate_indirect_obj(&doc->pdf);
-  pdf_pages_init(&doc->pdf, &pages);
-  pdf_content_init(&content);
+  doc = builder->doc;
+  count_forms(builder, begin, end);
   height = 842 - doc->top_margin;
-  for (gizmo = doc->gizmos; gizmo; gizmo = gizmo->next) {
+  for (gizmo = begin; gizmo != end; gizmo = gizmo->next) {
     switch (gizmo->type) {
     case GIZMO_TEXT:
       text = (struct gizmo_text *)gizmo;
       height -= text->font_size;
-      pdf_content_write_text(&content, text->str, doc->left_margin, height, text->font_size);
+      if ( (form = use_form(builder, text)) )
+        pdf_content_write_form(&builder->content, form->name,
+            doc->left_margin, height);
+      else
+        pdf_content_write_text(&builder->content, text->str, text->length,
+            doc->left_margin, height, text->font_size);
       break;
     case GIZMO_IMAGE:
       image = (struct gizmo_image *)gizmo;
       height -= image->h;
-      pdf_content_write_image(&content, image->name, doc->left_margin, height, image->w, image->h);
+      builder->xobjects = define_image(doc, builder->pdf, builder->xobjects,
+          image->name);
+      pdf_content_write_image(&builder->content, image->name,
+          doc->left_margin, height, image->w, image->h);
       break;
     case GIZMO_GLUE:
       glue = (struct gizmo_glue *)gizmo;
       if (glue->is_optimal) {
-        content_ref = pdf_allocate_indirect_obj(&doc->pdf);
-        pdf_content_define(&doc->pdf, content_ref, &content);
-        pdf_pages_add_page(&doc->pdf, &pages, content_ref);
-        pdf_content_reset_page(&content);
+        add_page(builder);
         height = 842 - doc->top_margin;
       } else {
         height -= glue->no_break_height;
       }
       break;
     default:
-      fprintf(stderr, "tw: Unknown gizmo type %d.\n", gizmo->type);
-      exit(1);
+      tw_fail(TW_ERR_INVALID, "tw: Unknown gizmo type %d.", gizmo->type);
     }
   }
-  content_ref = pdf_allocate_indirect_obj(&doc->pdf);
-  pdf_content_define(&doc->pdf, content_ref, &content);
-  pdf_pages_add_page(&doc->pdf, &pages, content_ref);
-  pdf_content_free(&content);
-  resources = pdf_content_create_resources(&doc->pdf, doc->xobjects);
-  pdf_pages_define_catalogue(&doc->pdf, catalogue_ref, &pages, resources);
-  pdf_pages_free(&pages);
+  add_page(builder);
+}
+
+/*
+ * Add the page of the gizmos from begin up to end, like build_page_range,
+ * unless the pdf would then be larger than max_bytes once its pages are
+ * ended. The pdf must be written immediately to out. The first page is
+ * always added. Returns 0 if the page doesn't fit, leaving the file as it
+ * was, after which the builder can only be ended.
+ */
+int
+build_page_within(struct page_builder *builder, struct pdf_output *out,
+    struct gizmo *begin, struct gizmo *end, long max_bytes)
+{
+  struct pdf *pdf;
+  struct pdf_obj_dictionary *xobjects;
+  struct tw_trap trap;
+  long length;
+  int obj_num, obj_count, digits;
+  pdf = builder->pdf;
+  obj_num = pdf->next_obj_num;
+  xobjects = builder->xobjects;
+  pdf_output_stage(out);
+  tw_push_trap(&trap);
+  if (setjmp(trap.env)) {
+    pdf_output_discard(out, pdf, obj_num);
+    tw_rethrow(&trap);
+  }
+  build_page_range(builder, begin, end);
+  tw_pop_trap(&trap);
+  /* Ending adds an object for each page. */
+  obj_count = pdf->next_obj_num + builder->pages.page_count;
+  digits = snprintf(NULL, 0, "%d", obj_count);
+  length = out->offset + pdf_xref_bound(obj_count)
+    + pdf_pages_bound(&builder->pages, pdf_content_resources_bound(
+          pdf_obj_length((struct pdf_obj *)builder->xobjects)), digits);
+  if (length > max_bytes && builder->pages.page_count > 1) {
+    pdf_output_discard(out, pdf, obj_num);
+    builder->pages.page_count--;
+    builder->xobjects = xobjects;
+    return 0;
+  }
+  pdf_output_commit(out);
+  return 1;
+}
+
+/* Define the page tree and catalogue, and free the builder. */
+void
+end_pages(struct page_builder *builder)
+{
+  struct pdf_obj *resources;
+  pdf_content_free(&builder->content);
+  resources = pdf_content_create_resources(builder->pdf, builder->xobjects);
+  pdf_pages_define_catalogue(builder->pdf, builder->catalogue_ref,
+      &builder->pages, resources);
+  pdf_pages_free(&builder->pages);
+  free(builder->forms);
+  free(builder);
 }
 
 void
-put_text(struct document *doc, const char *str, int font_size)
+put_text(struct document *doc, const char *str, int length, int font_size)
 {
   struct gizmo_text *text;
   text = xmalloc(sizeof(struct gizmo_text));
@@ -190,6 +718,7 @@ put_text(struct document *doc, const char *str, int font_size)
   text->next = NULL;
   text->font_size = font_size;
   text->str = str;
+  text->length = length;
   *doc->gizmos_end = (struct gizmo *)text;
   doc->gizmos_end = &text->next;
 }
@@ -199,8 +728,10 @@ put_image(struct document *doc, const char *fname, int w)
 {
   struct pdf_jpeg_info image_info;
   struct gizmo_image *image;
-  doc->xobjects = pdf_prepend_dictionary(&doc->pdf, doc->xobjects, fname,
-      (struct pdf_obj *)pdf_jpeg_define(&doc->pdf, fname, &image_info));
+  if (doc->jpeg_cache)
+    pdf_jpeg_cache_read_info(doc->jpeg_cache, fname, &image_info);
+  else
+    pdf_jpeg_read_info(fname, &image_info);
   image = xmalloc(sizeof(struct gizmo_image));
   image->type = GIZMO_IMAGE;
   image->next = NULL;
@@ -222,6 +753,7 @@ put_glue(struct document *doc, int break_penalty, int no_break_height)
   glue->no_break_height = no_break_height;
   glue->best_source = NULL;
   glue->best_total_penalty = 0;
+  glue->depth = 0;
   glue->is_optimal = 0;
   *doc->gizmos_end = (struct gizmo *)glue;
   doc->gizmos_end = &glue->next;
@@ -24,7 +24,9 @@ struct gizmo_text {
   int type;
   struct gizmo *next;
   int font_size;
+  /* A span, which need not be NUL terminated. */
   const char *str;
+  int length;
 };
 
 struct gizmo_image {
@@ -41,22 +43,66 @@ struct gizmo_glue {
   /* Shortest path attributes. */
   struct gizmo_glue *best_source;
   int best_total_penalty;
+  int depth;            /* Breaks on the best path to this glue. */
   int is_optimal;
 };
 
 struct document {
   int top_margin, bot_margin, left_margin;
   struct pdf pdf;
-  struct pdf_obj_dictionary *xobjects;
   struct gizmo *gizmos;
   struct gizmo **gizmos_end;
+  /* Optional, used by put_image when set. */
+  struct pdf_jpeg_cache *jpeg_cache;
 };
 
+/* A glue that can still be the source of later breaks. */
+struct layout_source {
+  struct gizmo_glue *glue;
+  long height;          /* Height of the gizmos up to and including it. */
+};
+
+/*
+ * Break optimisation fed one gizmo at a time. The best path to each glue is
+ * final once it is pushed, and breaks shared by the best paths to every
+ * possible source are certain to be optimal before the input ends.
+ */
+struct layout {
+  int max_height;
+  long height;
+  struct gizmo_glue start;
+  struct layout_source *sources;
+  int source_begin, source_end, source_allocated;
+  /* Sources that stopped at the last gizmo begin here. */
+  int last_begin;
+  struct gizmo_glue *committed;
+};
+
+/* Adds pages to a pdf a range of gizmos at a time, see document.c. */
+struct page_builder;
+
 int gizmo_height(const struct gizmo *gizmo);
+void layout_init(struct layout *layout, struct document *doc);
+void layout_free(struct layout *layout);
+void layout_push(struct layout *layout, struct gizmo *gizmo);
+struct gizmo_glue *layout_commit(struct layout *layout);
+struct gizmo_glue *layout_force(struct layout *layout);
+int layout_finish(struct layout *layout);
 void optimise_breaks(struct document *doc);
+int optimal_penalty(struct document *doc);
 void init_document(struct document *doc, int top_margin, int bot_margin, int left_margin);
 void free_document(struct document *doc);
 void build_document(struct document *doc);
-void put_text(struct document *doc, const char *str, int font_size);
+void write_document(struct document *doc, const char *fname);
+void build_pages(struct document *doc, struct pdf *pdf, struct gizmo *begin,
+    struct gizmo *end);
+struct page_builder *begin_pages(struct document *doc, struct pdf *pdf);
+void build_page_range(struct page_builder *builder, struct gizmo *begin,
+    struct gizmo *end);
+int build_page_within(struct page_builder *builder, struct pdf_output *out,
+    struct gizmo *begin, struct gizmo *end, long max_bytes);
+void end_pages(struct page_builder *builder);
+void put_text(struct document *doc, const char *str, int length,
+    int font_size);
 void put_image(struct document *doc, const char *fname, int w);
 void put_glue(struct document *doc, int break_penalty, int no_break_height);
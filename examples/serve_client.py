@@ -0,0 +1,33 @@
+import socket
+import sys
+
+# Send standard input to a running tw-serve and save the PDF it returns.
+# Usage: python3 serve_client.py socket output.pdf [options...] < input.txt
+
+if len(sys.argv) < 3:
+    sys.stderr.write("Usage: serve_client.py socket output.pdf [options...]\n")
+    exit(1)
+
+header = " ".join('"%s"' % arg if " " in arg else arg for arg in sys.argv[3:])
+
+sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+sock.connect(sys.argv[1])
+sock.sendall(header.encode() + b"\n")
+sock.sendall(sys.stdin.buffer.read())
+sock.shutdown(socket.SHUT_WR)
+
+pdf = b""
+while True:
+    data = sock.recv(65536)
+    if not data:
+        break
+    pdf += data
+sock.close()
+
+# A job that failed is closed with nothing sent back; tw-serve prints why.
+if not pdf:
+    sys.stderr.write("tw-serve failed to render the job.\n")
+    exit(1)
+
+with open(sys.argv[2], "wb") as out:
+    out.write(pdf)
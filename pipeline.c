@@ -0,0 +1,232 @@
+/*
+ * Copyright (C) 2023 Christopher Lang
+ * See LICENSE for license details.
+ */
+
+/*
+ * Reading, break optimisation and writing run at the same time, each in its
+ * own thread, so a slow input or output only costs its own stage.
+ *
+ * The reader appends gizmos to the document and passes the last gizmo of
+ * each batch of lines to the layout stage. Layout passes each break as soon
+ * as it is certain to be optimal to the writer, which formats the pages up
+ * to it and writes them out, freeing their streams as it goes. Gizmos are
+ * only ever read by a stage after it has received a later one, so every link
+ * it follows has been written.
+ */
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "twpdf.h"
+#include "document.h"
+#include "stralloc.h"
+#include "raw.h"
+#include "spsc.h"
+#include "pipeline.h"
+
+#define BATCH_LINES 64
+#define QUEUE_SIZE 256
+/*
+ * The best paths may not meet for many batches, such as over a long run of
+ * lines that could break anywhere, and each commit walks back to the last
+ * one, so failed commits are retried less often.
+ */
+#define MAX_COMMIT_INTERVAL 64
+
+struct pipeline {
+  struct raw_context *ctx;
+  struct document *doc;
+  FILE *input, *output;
+  struct spsc_queue batches;    /* Last gizmo of each batch read. */
+  struct spsc_queue breaks;     /* Optimal breaks, in order. */
+  int lookahead;                /* Pages, or 0 to wait for the optimum. */
+  int total_penalty;
+};
+
+static void *read_stage(void *arg);
+static void layout_stage(struct pipeline *p);
+static void lookahead_stage(struct pipeline *p);
+static void *write_stage(void *arg);
+
+/* Ends both queues. */
+static struct gizmo end_of_input;
+
+static void *
+read_stage(void *arg)
+{
+  struct pipeline *p;
+  struct gizmo *last, *gizmo;
+  int more;
+  p = arg;
+  last = NULL;
+  do {
+    more = raw_read_lines(p->ctx, p->doc, p->input, BATCH_LINES);
+    gizmo = last ? last->next : p->doc->gizmos;
+    if (gizmo == NULL)
+      continue;
+    while (gizmo->next)
+      gizmo = gizmo->next;
+    last = gizmo;
+    spsc_push(&p->batches, last);
+  } while (more);
+  spsc_push(&p->batches, &end_of_input);
+  return NULL;
+}
+
+static void
+layout_stage(struct pipeline *p)
+{
+  struct layout layout;
+  struct gizmo *gizmo, *last, *prev_last;
+  struct gizmo_glue *glue;
+  int batches, next_commit, interval;
+  layout_init(&layout, p->doc);
+  prev_last = NULL;
+  batches = next_commit = 0;
+  interval = 1;
+  while ( (last = spsc_pop(&p->batches)) != &end_of_input) {
+    for (gizmo = prev_last ? prev_last->next : p->doc->gizmos; ;
+        gizmo = gizmo->next) {
+      layout_push(&layout, gizmo);
+      if (gizmo == last)
+        break;
+    }
+    prev_last = last;
+    if (++batches < next_commit)
+      continue;
+    if ( (glue = layout_commit(&layout)) ) {
+      spsc_push(&p->breaks, glue);
+      interval = 1;
+    } else if (interval < MAX_COMMIT_INTERVAL) {
+      interval *= 2;
+    }
+    next_commit = batches + interval;
+  }
+  p->total_penalty = layout_finish(&layout);
+  spsc_push(&p->breaks, &end_of_input);
+  layout_free(&layout);
+}
+
+/*
+ * Once the gizmos after the last break fill more than the lookahead, the
+ * first break on the best path so far is taken and layout starts again from
+ * it, so each page is decided from a bounded amount of input.
+ */
+static void
+lookahead_stage(struct pipeline *p)
+{
+  struct layout layout;
+  struct gizmo *gizmo, *last, *pushed;
+  struct gizmo_glue *glue;
+  long max_height;
+  int break_penalty;
+  layout_init(&layout, p->doc);
+  max_height = (long)p->lookahead * layout.max_height;
+  pushed = NULL;
+  break_penalty = 0;
+  p->total_penalty = 0;
+  while ( (last = spsc_pop(&p->batches)) != &end_of_input) {
+    do {
+      gizmo = pushed ? pushed->next : p->doc->gizmos;
+      layout_push(&layout, gizmo);
+      pushed = gizmo;
+      while (layout.height > max_height && (glue = layout_force(&layout))) {
+        /* The start of each layout has no penalty of its own. */
+        p->total_penalty += break_penalty + glue->best_total_penalty;
+        break_penalty = glue->break_penalty;
+        spsc_push(&p->breaks, glue);
+        layout_free(&layout);
+        layout_init(&layout, p->doc);
+        /* pushed may be the last gizmo read, whose next isn't ours to read. */
+        if ((struct gizmo *)glue == pushed)
+          continue;
+        for (gizmo = glue->next; ; gizmo = gizmo->next) {
+          layout_push(&layout, gizmo);
+          if (gizmo == pushed)
+            break;
+        }
+      }
+    } while (pushed != last);
+  }
+  p->total_penalty += break_penalty + layout_finish(&layout);
+  spsc_push(&p->breaks, &end_of_input);
+  layout_free(&layout);
+}
+
+static void *
+write_stage(void *arg)
+{
+  struct pipeline *p;
+  struct pdf_output out;
+  struct page_builder *builder;
+  struct gizmo *end, *prev_end;
+  p = arg;
+  builder = begin_pages(p->doc, &p->doc->pdf);
+  pdf_output_begin(&out, p->output);
+  pdf_output_immediate(&out, &p->doc->pdf);
+  prev_end = NULL;
+  do {
+    end = spsc_pop(&p->breaks);
+    build_page_range(builder, prev_end ? prev_end->next : p->doc->gizmos,
+        end == &end_of_input ? NULL : end);
+    /* Let a reader of the file see each page as soon as it is decided. */
+    fflush(p->output);
+    prev_end = end;
+  } while (end != &end_of_input);
+  end_pages(builder);
+  pdf_output_end(&out, &p->doc->pdf);
+  return NULL;
+}
+
+/*
+ * Read, lay out and write input as a PDF to fname, or standard output for
+ * "-". The document must be empty. Each break is chosen from at most
+ * lookahead pages of input unless lookahead is 0. Returns the total penalty
+ * of the breaks.
+ */
+int
+write_pipelined(struct raw_context *ctx, struct document *doc, FILE *input,
+    const char *fname, int lookahead)
+{
+  struct pipeline p;
+  pthread_t reader, writer;
+
+  p.ctx = ctx;
+  p.doc = doc;
+  p.input = input;
+  p.lookahead = lookahead;
+  p.output = strcmp(fname, "-") == 0 ? stdout : fopen(fname, "w");
+  if (p.output == NULL) {
+    fprintf(stderr, "Failed to open file %s.\n", fname);
+    exit(1);
+  }
+  spsc_init(&p.batches, QUEUE_SIZE);
+  spsc_init(&p.breaks, QUEUE_SIZE);
+  if (pthread_create(&reader, NULL, read_stage, &p)
+      || pthread_create(&writer, NULL, write_stage, &p)) {
+    fprintf(stderr, "Failed to create pipeline thread.\n");
+    exit(1);
+  }
+  if (lookahead)
+    lookahead_stage(&p);
+  else
+    layout_stage(&p);
+  pthread_join(reader, NULL);
+  pthread_join(writer, NULL);
+  spsc_free(&p.batches);
+  spsc_free(&p.breaks);
+
+  if (fflush(p.output) || ferror(p.output)) {
+    fprintf(stderr, "Error writing file %s.\n", fname);
+    exit(1);
+  }
+  if (p.output != stdout)
+    fclose(p.output);
+  return p.total_penalty;
+}
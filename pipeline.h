@@ -0,0 +1,16 @@
+/*
+ * Copyright (C) 2023 Christopher Lang
+ * See LICENSE for license details.
+ */
+
+/*
+ * The following must be included before this file:
+#include <stdio.h>
+#include "twpdf.h"
+#include "document.h"
+#include "stralloc.h"
+#include "raw.h"
+ */
+
+int write_pipelined(struct raw_context *ctx, struct document *doc,
+    FILE *input, const char *fname, int lookahead);
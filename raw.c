@@ -0,0 +1,213 @@
+/*
+ * Copyright (C) 2023 Christopher Lang
+ * See LICENSE for license details.
+ */
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "twpdf.h"
+#include "document.h"
+#include "stralloc.h"
+#include "arg.h"
+#include "raw.h"
+#include "winansi.h"
+#include "sha256.h"
+#include "cache.h"
+
+static int read_line(struct raw_context *ctx, FILE *file);
+static void put_text_line(struct raw_context *ctx, struct document *doc,
+    int len);
+static void put_image_line(struct raw_context *ctx, struct document *doc,
+    int len);
+
+/* Returns the length of the line read, or -1 at the end of the file. */
+static int
+read_line(struct raw_context *ctx, FILE *file)
+{
+  int c, len, i;
+  const char *tab_expand;
+  tab_expand = ctx->opts.tab_expand;
+  len = 0;
+  while ( (c = fgetc(file)) != EOF) {
+    if (len + 64 >= ctx->line_allocated) {
+      ctx->line_allocated += 256;
+      ctx->line = xrealloc(ctx->line, ctx->line_allocated);
+    }
+    switch (c) {
+    case '\r':
+      break;
+    case '\n':
+      ctx->line[len] = '\0';
+      return len;
+    case '\t':
+      for (i = 0; tab_expand[i] != '\0'; i++)
+        ctx->line[len++] = tab_expand[i];
+      break;
+    default:
+      ctx->line[len++] = c;
+    }
+  }
+  ctx->line[len] = '\0';
+  return -1;
+}
+
+/* Put the line read as text, which is read as UTF-8. */
+static void
+put_text_line(struct raw_context *ctx, struct document *doc, int len)
+{
+  len = winansi_from_utf8(ctx->line, len);
+  put_text(doc, stralloc_copy(&ctx->stralloc, ctx->line, len), len,
+      ctx->opts.font_size);
+}
+
+static void
+put_image_line(struct raw_context *ctx, struct document *doc, int len)
+{
+  char *str;
+  int font_size;
+  font_size = ctx->opts.font_size;
+  str = ctx->line;
+  if (len == 0) {
+    put_glue(doc, font_size * 30, font_size);
+  } else if (strcmp(str, "---") == 0) {
+    put_glue(doc, 0, 0);
+  } else if (strncmp(str, "!IMAGE_SIZE ", strlen("!IMAGE_SIZE ")) == 0) {
+    str += strlen("!IMAGE_SIZE ");
+    ctx->image_size = atoi(str);
+  } else if (strncmp(str, "!IMAGE ", strlen("!IMAGE ")) == 0) {
+    str += strlen("!IMAGE ");
+    put_glue(doc, font_size * 40, font_size / 2);
+    put_image(doc, stralloc_alloc(&ctx->stralloc, str), ctx->image_size);
+  } else {
+    put_glue(doc, font_size * 40, font_size / 2);
+    put_text_line(ctx, doc, len);
+  }
+}
+
+void
+raw_default_options(struct raw_options *opts)
+{
+  opts->font_size = 9;
+  opts->top_margin = 40;
+  opts->bot_margin = 40;
+  opts->left_margin = 80;
+  opts->right_margin = 80;
+  opts->tab_expand = "    ";
+  opts->images = 0;
+}
+
+/*
+ * Apply an option parsed with RAW_OPT_STRING. Returns 0 if c is not one of
+ * them and -1 if its argument is invalid.
+ */
+int
+raw_set_opt(struct raw_options *opts, int c)
+{
+  switch (c) {
+  case 's':
+    opts->font_size = opt_arg_int;
+    return 1;
+  case 'v':
+    opts->top_margin = opt_arg_int;
+    opts->bot_margin = opt_arg_int;
+    return 1;
+  case 'h':
+    opts->left_margin = opt_arg_int;
+    opts->right_margin = opt_arg_int;
+    return 1;
+  case 't':
+    opts->tab_expand = opt_arg_string;
+    if (strlen(opts->tab_expand) > 32) {
+      fprintf(stderr, "Tab expand too long.\n");
+      return -1;
+    }
+    return 1;
+  }
+  return 0;
+}
+
+void
+raw_init_context(struct raw_context *ctx)
+{
+  raw_default_options(&ctx->opts);
+  stralloc_init(&ctx->stralloc);
+  ctx->line_allocated = 256;
+  ctx->line = xmalloc(ctx->line_allocated);
+  ctx->jpeg_cache = NULL;
+}
+
+/* Drop the strings of the previous job. Options are left for the caller. */
+void
+raw_reset_context(struct raw_context *ctx)
+{
+  stralloc_reset(&ctx->stralloc);
+}
+
+void
+raw_free_context(struct raw_context *ctx)
+{
+  stralloc_free(&ctx->stralloc);
+  free(ctx->line);
+}
+
+void
+raw_init_document(struct raw_context *ctx, struct document *doc)
+{
+  init_document(doc, ctx->opts.top_margin, ctx->opts.bot_margin,
+      ctx->opts.left_margin);
+  doc->jpeg_cache = ctx->jpeg_cache;
+  ctx->image_size = 595 - ctx->opts.left_margin - ctx->opts.right_margin;
+}
+
+/* Read up to max_lines lines. Returns 0 once the end of file is reached. */
+int
+raw_read_lines(struct raw_context *ctx, struct document *doc, FILE *file,
+    int max_lines)
+{
+  int len;
+  for (; max_lines > 0; max_lines--) {
+    if ( (len = read_line(ctx, file)) == -1)
+      return 0;
+    if (ctx->opts.images) {
+      put_image_line(ctx, doc, len);
+    } else {
+      put_text_line(ctx, doc, len);
+      put_glue(doc, 0, 0);
+    }
+  }
+  return 1;
+}
+
+void
+raw_read_file(struct raw_context *ctx, struct document *doc, FILE *file)
+{
+  while (raw_read_lines(ctx, doc, file, 1024))
+    ;
+}
+
+/*
+ * Add the options and the images the lines of file refer to, to the key of
+ * a document made from file. The input itself is left to the caller.
+ */
+void
+raw_add_cache_key(struct raw_context *ctx, struct cache *cache, FILE *file)
+{
+  const char *image = "!IMAGE ";
+  cache_add_int(cache, ctx->opts.font_size);
+  cache_add_int(cache, ctx->opts.top_margin);
+  cache_add_int(cache, ctx->opts.bot_margin);
+  cache_add_int(cache, ctx->opts.left_margin);
+  cache_add_int(cache, ctx->opts.right_margin);
+  cache_add_string(cache, ctx->opts.tab_expand);
+  cache_add_int(cache, ctx->opts.images);
+  if (!ctx->opts.images)
+    return;
+  while (read_line(ctx, file) != -1)
+    if (strncmp(ctx->line, image, strlen(image)) == 0)
+      cache_add_file(cache, ctx->line + strlen(image));
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2023 Christopher Lang
+ * See LICENSE for license details.
+ */
+
+/*
+ * The following must be included before this file:
+#include <stdio.h>
+#include "twpdf.h"
+#include "document.h"
+#include "stralloc.h"
+ */
+
+/*
+ * Options shared by the line based formatters. With images set, lines are
+ * read the way tw-image reads them, otherwise every line is raw text.
+ */
+struct raw_options {
+  int font_size;
+  int top_margin, bot_margin, left_margin, right_margin;
+  const char *tab_expand;
+  int images;
+};
+
+/*
+ * Everything needed to format one raw text job. A context can be reused for
+ * many jobs in turn, keeping its string blocks and line buffer.
+ */
+struct raw_context {
+  struct raw_options opts;
+  struct stralloc stralloc;
+  char *line;
+  int line_allocated;
+  /* Width of images, which !IMAGE_SIZE lines change. */
+  int image_size;
+  /* Optional, shared by contexts that format images. */
+  struct pdf_jpeg_cache *jpeg_cache;
+};
+
+#define RAW_OPT_STRING "s#v#h#t*"
+
+/* See cache.h. */
+struct cache;
+
+void raw_default_options(struct raw_options *opts);
+int raw_set_opt(struct raw_options *opts, int c);
+void raw_init_context(struct raw_context *ctx);
+void raw_reset_context(struct raw_context *ctx);
+void raw_free_context(struct raw_context *ctx);
+void raw_init_document(struct raw_context *ctx, struct document *doc);
+int raw_read_lines(struct raw_context *ctx, struct document *doc, FILE *file,
+    int max_lines);
+void raw_read_file(struct raw_context *ctx, struct document *doc, FILE *file);
+void raw_add_cache_key(struct raw_context *ctx, struct cache *cache,
+    FILE *file);
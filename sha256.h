@@ -0,0 +1,19 @@
+/*
+ * Copyright (C) 2023 Christopher Lang
+ * See LICENSE for license details.
+ */
+
+/*
+ * The following must be included before this file:
+#include <stdint.h>
+ */
+
+struct sha256 {
+  uint32_t state[8];
+  uint64_t length;
+  unsigned char block[64];
+};
+
+void sha256_init(struct sha256 *sha);
+void sha256_update(struct sha256 *sha, const void *bytes, long length);
+void sha256_final(struct sha256 *sha, unsigned char digest[32]);
@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2023 Christopher Lang
+ * See LICENSE for license details.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "twpdf.h"
+#include "document.h"
+#include "shard.h"
+
+struct shard {
+  struct gizmo *begin, *end;
+  char *fname;
+};
+
+struct shard_list {
+  struct document *doc;
+  struct shard *shards;
+  int shard_count;
+  pthread_mutex_t mutex;
+  int next_shard;
+};
+
+static char *shard_fname(const char *fname, int index);
+static int cut_shards(struct document *doc, int pages_per_shard,
+    struct shard **shards);
+static void *shard_worker(void *arg);
+static struct gizmo *next_break(struct gizmo *begin);
+static int write_bounded_shard(struct document *doc, struct gizmo **begin,
+    long max_bytes, const char *fname);
+
+/* "out.pdf" gives "out-000.pdf", "out-001.pdf" and so on. */
+static char *
+shard_fname(const char *fname, int index)
+{
+  char *name;
+  int base_len;
+  base_len = strlen(fname);
+  if (base_len > 4 && strcmp(fname + base_len - 4, ".pdf") == 0)
+    base_len -= 4;
+  name = xmalloc(base_len + 16);
+  sprintf(name, "%.*s-%03d.pdf", base_len, fname, index);
+  return name;
+}
+
+/* Cut the optimal break chain into runs of at most pages_per_shard pages. */
+static int
+cut_shards(struct document *doc, int pages_per_shard, struct shard **shards)
+{
+  struct gizmo *gizmo;
+  int shard_count, shard_allocated, pages;
+  shard_allocated = 16;
+  *shards = xmalloc(shard_allocated * sizeof(struct shard));
+  shard_count = 1;
+  (*shards)[0].begin = doc->gizmos;
+  pages = 1;
+  for (gizmo = doc->gizmos; gizmo; gizmo = gizmo->next) {
+    if (gizmo->type != GIZMO_GLUE || !((struct gizmo_glue *)gizmo)->is_optimal)
+      continue;
+    if (pages++ < pages_per_shard)
+      continue;
+    if (shard_count == shard_allocated) {
+      shard_allocated *= 2;
+      *shards = xrealloc(*shards, shard_allocated * sizeof(struct shard));
+    }
+    (*shards)[shard_count - 1].end = gizmo;
+    (*shards)[shard_count++].begin = gizmo->next;
+    pages = 1;
+  }
+  (*shards)[shard_count - 1].end = NULL;
+  return shard_count;
+}
+
+static void *
+shard_worker(void *arg)
+{
+  struct shard_list *list;
+  struct shard *shard;
+  struct pdf pdf;
+  list = arg;
+  for (;;) {
+    pthread_mutex_lock(&list->mutex);
+    shard = list->next_shard < list->shard_count
+      ? &list->shards[list->next_shard++] : NULL;
+    pthread_mutex_unlock(&list->mutex);
+    if (shard == NULL)
+      break;
+    pdf_init_empty(&pdf);
+    pdf.linearize = list->doc->pdf.linearize;
+    pdf.memory_budget = list->doc->pdf.memory_budget;
+    pdf.ascii85 = list->doc->pdf.ascii85;
+    build_pages(list->doc, &pdf, shard->begin, shard->end);
+    pdf_write(&pdf, shard->fname);
+    pdf_free(&pdf);
+  }
+  return NULL;
+}
+
+/* The optimal break ending the page that starts at begin, or NULL. */
+static struct gizmo *
+next_break(struct gizmo *begin)
+{
+  struct gizmo *gizmo;
+  for (gizmo = begin; gizmo; gizmo = gizmo->next)
+    if (gizmo->type == GIZMO_GLUE && ((struct gizmo_glue *)gizmo)->is_optimal)
+      return gizmo;
+  return NULL;
+}
+
+/*
+ * Write the pages from *begin into fname while the file stays within
+ * max_bytes, and at least one page. Returns 1, with *begin at the page the
+ * next file starts with, if any pages are left.
+ */
+static int
+write_bounded_shard(struct document *doc, struct gizmo **begin,
+    long max_bytes, const char *fname)
+{
+  struct page_builder *builder;
+  struct pdf_output out;
+  struct gizmo *end;
+  struct pdf pdf;
+  FILE *file;
+  int page_count, more;
+  if ( (file = fopen(fname, "w")) == NULL) {
+    fprintf(stderr, "tw: Failed to open file %s.\n", fname);
+    exit(1);
+  }
+  pdf_init_empty(&pdf);
+  pdf.memory_budget = doc->pdf.memory_budget;
+  pdf.ascii85 = doc->pdf.ascii85;
+  pdf_output_begin(&out, file);
+  pdf_output_immediate(&out, &pdf);
+  builder = begin_pages(doc, &pdf);
+  page_count = 0;
+  do {
+    end = next_break(*begin);
+    if ( (more = !build_page_within(builder, &out, *begin, end, max_bytes)) )
+      break;
+    page_count++;
+    *begin = end ? end->next : NULL;
+  } while ( (more = end != NULL) );
+  end_pages(builder);
+  pdf_output_end(&out, &pdf);
+  if (fflush(file) || ferror(file)) {
+    fprintf(stderr, "tw: Error writing file %s.\n", fname);
+    exit(1);
+  }
+  if (page_count == 1 && ftell(file) > max_bytes)
+    fprintf(stderr, "tw: A page alone makes %s larger than %ld bytes.\n",
+        fname, max_bytes);
+  fclose(file);
+  pdf_free(&pdf);
+  return more;
+}
+
+/*
+ * Write an optimised document as PDFs of at most max_bytes each, named after
+ * fname like write_shards. Each file takes as many pages as fit, decided while
+ * its pages are built, so the document is gone through once. A page that is
+ * larger than max_bytes on its own still gets a file.
+ * Returns the number of files written.
+ */
+int
+write_bounded_shards(struct document *doc, long max_bytes, const char *fname)
+{
+  struct gizmo *begin;
+  char *shard;
+  int i, more;
+  if (max_bytes < 1) {
+    fprintf(stderr, "tw: Files must be allowed at least one byte.\n");
+    exit(1);
+  }
+  begin = doc->gizmos;
+  i = 0;
+  do {
+    shard = shard_fname(fname, i++);
+    more = write_bounded_shard(doc, &begin, max_bytes, shard);
+    free(shard);
+  } while (more);
+  return i;
+}
+
+/*
+ * Write an optimised document as several PDFs of at most pages_per_shard
+ * pages, named after fname. Shards are built and written in parallel, with
+ * the write options of the document's own pdf.
+ * Returns the number of files written.
+ */
+int
+write_shards(struct document *doc, int pages_per_shard, const char *fname)
+{
+  struct shard_list list;
+  pthread_t *threads;
+  int i, thread_count;
+
+  if (pages_per_shard < 1) {
+    fprintf(stderr, "tw: Shards must have at least one page.\n");
+    exit(1);
+  }
+  list.doc = doc;
+  list.shard_count = cut_shards(doc, pages_per_shard, &list.shards);
+  for (i = 0; i < list.shard_count; i++)
+    list.shards[i].fname = shard_fname(fname, i);
+  pthread_mutex_init(&list.mutex, NULL);
+  list.next_shard = 0;
+
+  thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+  if (thread_count > list.shard_count)
+    thread_count = list.shard_count;
+  if (thread_count < 1)
+    thread_count = 1;
+  threads = xmalloc(thread_count * sizeof(pthread_t));
+  for (i = 0; i < thread_count; i++)
+    if (pthread_create(&threads[i], NULL, shard_worker, &list)) {
+      fprintf(stderr, "tw: Failed to create shard thread.\n");
+      exit(1);
+    }
+  for (i = 0; i < thread_count; i++)
+    pthread_join(threads[i], NULL);
+
+  free(threads);
+  pthread_mutex_destroy(&list.mutex);
+  for (i = 0; i < list.shard_count; i++)
+    free(list.shards[i].fname);
+  free(list.shards);
+  return i;
+}
@@ -0,0 +1,14 @@
+/*
+ * Copyright (C) 2023 Christopher Lang
+ * See LICENSE for license details.
+ */
+
+/*
+ * The following must be included before this file:
+#include "twpdf.h"
+#include "document.h"
+ */
+
+int write_shards(struct document *doc, int pages_per_shard, const char *fname);
+int write_bounded_shards(struct document *doc, long max_bytes,
+    const char *fname);
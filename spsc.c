@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2023 Christopher Lang
+ * See LICENSE for license details.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "utils.h"
+#include "spsc.h"
+
+static int backoff(int *waits);
+static void begin_sleep(struct spsc_queue *queue);
+static void end_sleep(struct spsc_queue *queue);
+static void wake(struct spsc_queue *queue);
+
+/* Spin briefly, then yield. Returns 0 once it is time to sleep instead. */
+static int
+backoff(int *waits)
+{
+  if (*waits < 16) {
+    (*waits)++;
+    return 1;
+  }
+  if (*waits < 48) {
+    (*waits)++;
+    sched_yield();
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Announce a sleep before trying the queue once more, so that either the try
+ * sees what the other side did, or the other side sees the flag and wakes us.
+ * The mutex is held until waiting releases it.
+ */
+static void
+begin_sleep(struct spsc_queue *queue)
+{
+  pthread_mutex_lock(&queue->mutex);
+  atomic_store_explicit(&queue->sleeping, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+}
+
+static void
+end_sleep(struct spsc_queue *queue)
+{
+  atomic_store_explicit(&queue->sleeping, 0, memory_order_relaxed);
+  pthread_mutex_unlock(&queue->mutex);
+}
+
+/* Wake the other side if it sleeps, after a push or pop. */
+static void
+wake(struct spsc_queue *queue)
+{
+  atomic_thread_fence(memory_order_seq_cst);
+  if (!atomic_load_explicit(&queue->sleeping, memory_order_relaxed))
+    return;
+  pthread_mutex_lock(&queue->mutex);
+  pthread_cond_signal(&queue->wake);
+  pthread_mutex_unlock(&queue->mutex);
+}
+
+/* capacity is rounded up to a power of two. */
+void
+spsc_init(struct spsc_queue *queue, int capacity)
+{
+  unsigned long size;
+  for (size = 1; size < (unsigned long)capacity; size *= 2)
+    ;
+  atomic_init(&queue->head, 0);
+  atomic_init(&queue->tail, 0);
+  queue->mask = size - 1;
+  queue->slots = xmalloc(size * sizeof(void *));
+  atomic_init(&queue->sleeping, 0);
+  pthread_mutex_init(&queue->mutex, NULL);
+  pthread_cond_init(&queue->wake, NULL);
+}
+
+void
+spsc_free(struct spsc_queue *queue)
+{
+  free(queue->slots);
+  pthread_mutex_destroy(&queue->mutex);
+  pthread_cond_destroy(&queue->wake);
+}
+
+/* Returns 0 if the queue is full. */
+int
+spsc_try_push(struct spsc_queue *queue, void *item)
+{
+  unsigned long tail;
+  tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  if (tail - atomic_load_explicit(&queue->head, memory_order_acquire)
+      > queue->mask)
+    return 0;
+  queue->slots[tail & queue->mask] = item;
+  atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+  return 1;
+}
+
+/* Returns NULL if the queue is empty. */
+void *
+spsc_try_pop(struct spsc_queue *queue)
+{
+  unsigned long head;
+  void *item;
+  head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  if (head == atomic_load_explicit(&queue->tail, memory_order_acquire))
+    return NULL;
+  item = queue->slots[head & queue->mask];
+  atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+  return item;
+}
+
+void
+spsc_push(struct spsc_queue *queue, void *item)
+{
+  int waits, pushed;
+  waits = 0;
+  while (!(pushed = spsc_try_push(queue, item)) && backoff(&waits))
+    ;
+  if (!pushed) {
+    begin_sleep(queue);
+    while (!spsc_try_push(queue, item))
+      pthread_cond_wait(&queue->wake, &queue->mutex);
+    end_sleep(queue);
+  }
+  wake(queue);
+}
+
+void *
+spsc_pop(struct spsc_queue *queue)
+{
+  void *item;
+  int waits;
+  waits = 0;
+  while ( (item = spsc_try_pop(queue)) == NULL && backoff(&waits))
+    ;
+  if (item == NULL) {
+    begin_sleep(queue);
+    while ( (item = spsc_try_pop(queue)) == NULL)
+      pthread_cond_wait(&queue->wake, &queue->mutex);
+    end_sleep(queue);
+  }
+  wake(queue);
+  return item;
+}
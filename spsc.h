@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2023 Christopher Lang
+ * See LICENSE for license details.
+ */
+
+/*
+ * The following must be included before this file:
+#include <pthread.h>
+#include <stdatomic.h>
+ */
+
+/*
+ * A bounded lock-free queue of pointers from one producer thread to one
+ * consumer thread. Each index is only written by one side, and they are kept
+ * on separate cache lines. Items can't be NULL. A side that has waited a
+ * while sleeps until the other side wakes it.
+ */
+struct spsc_queue {
+  _Alignas(64) atomic_ulong head;       /* Next slot to pop. */
+  _Alignas(64) atomic_ulong tail;       /* Next slot to push. */
+  _Alignas(64) unsigned long mask;
+  void **slots;
+  atomic_int sleeping;
+  pthread_mutex_t mutex;
+  pthread_cond_t wake;
+};
+
+void spsc_init(struct spsc_queue *queue, int capacity);
+void spsc_free(struct spsc_queue *queue);
+int spsc_try_push(struct spsc_queue *queue, void *item);
+void *spsc_try_pop(struct spsc_queue *queue);
+void spsc_push(struct spsc_queue *queue, void *item);
+void *spsc_pop(struct spsc_queue *queue);
@@ -10,30 +10,88 @@
 #include "utils.h"
 #include "stralloc.h"
 
+#define STR_BLOCK_SIZE (64 * 1024)
+
+static struct str_block *take_block(struct stralloc *stralloc, long size);
+static void free_blocks(struct str_block *block);
+
+static struct str_block *
+take_block(struct stralloc *stralloc, long size)
+{
+  struct str_block *block;
+  if (stralloc->spare && stralloc->spare->allocated >= size) {
+    block = stralloc->spare;
+    stralloc->spare = block->next;
+  } else {
+    if (size < STR_BLOCK_SIZE)
+      size = STR_BLOCK_SIZE;
+    block = xmalloc(sizeof(struct str_block) + size);
+    block->allocated = size;
+  }
+  block->used = 0;
+  block->next = stralloc->blocks;
+  stralloc->blocks = block;
+  return block;
+}
+
+static void
+free_blocks(struct str_block *block)
+{
+  struct str_block *next_block;
+  for (; block; block = next_block) {
+    next_block = block->next;
+    free(block);
+  }
+}
+
 void 
 stralloc_init(struct stralloc *stralloc)
 {
-  stralloc->strs = NULL;
+  stralloc->blocks = NULL;
+  stralloc->spare = NULL;
+}
+
+void
+stralloc_reset(struct stralloc *stralloc)
+{
+  struct str_block *block, *next_block;
+  for (block = stralloc->blocks; block; block = next_block) {
+    next_block = block->next;
+    block->next = stralloc->spare;
+    stralloc->spare = block;
+  }
+  stralloc->blocks = NULL;
 }
 
 void 
 stralloc_free(struct stralloc *stralloc)
 {
-  struct str *str, *next_str;
-  for (str = stralloc->strs; str; str = next_str) {
-    next_str = str->next;
-    free(str);
-  }
+  free_blocks(stralloc->blocks);
+  free_blocks(stralloc->spare);
+  stralloc->blocks = NULL;
+  stralloc->spare = NULL;
 }
 
 char *
 stralloc_alloc(struct stralloc *stralloc, const char *str)
 {
-  struct str *s;
+  return stralloc_copy(stralloc, str, strlen(str));
+}
+
+/* Copy a span of known length, NUL terminating the copy. */
+char *
+stralloc_copy(struct stralloc *stralloc, const char *bytes, long length)
+{
+  struct str_block *block;
+  char *s;
   long size;
-  size = strlen(str) + 1;
-  s = xmalloc(sizeof(struct str) + size);
-  s->next = stralloc->strs;
-  memcpy(s->str, str, size);
-  return s->str;
+  size = length + 1;
+  block = stralloc->blocks;
+  if (block == NULL || block->allocated - block->used < size)
+    block = take_block(stralloc, size);
+  s = block->bytes + block->used;
+  block->used += size;
+  memcpy(s, bytes, length);
+  s[length] = '\0';
+  return s;
 }
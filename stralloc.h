@@ -3,15 +3,23 @@
  * See LICENSE for license details.
  */
 
-struct str {
-  struct str *next;
-  char str[];
+/*
+ * Strings are packed into large blocks. Resetting an allocator keeps its
+ * blocks for reuse, so one allocator can serve many documents in turn.
+ */
+struct str_block {
+  struct str_block *next;
+  long allocated, used;
+  char bytes[];
 };
 
 struct stralloc {
-  struct str *strs;
+  struct str_block *blocks;
+  struct str_block *spare;
 };
 
 void stralloc_init(struct stralloc *stralloc);
+void stralloc_reset(struct stralloc *stralloc);
 void stralloc_free(struct stralloc *stralloc);
 char *stralloc_alloc(struct stralloc *stralloc, const char *str);
+char *stralloc_copy(struct stralloc *stralloc, const char *bytes, long length);
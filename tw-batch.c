@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2023 Christopher Lang
+ * See LICENSE for license details.
+ */
+
+/*
+ * Convert many text files to PDFs in one process.
+ *
+ * Each line of the manifest names an input file, an output file and
+ * optionally any of the tw-raw options -s -v -h -t:
+ *
+ *   notes.txt notes.pdf
+ *   code.c code.pdf -s 8 -t "  "
+ *
+ * Blank lines and lines starting with '#' are ignored. Jobs are shared out
+ * between worker threads, each of which reuses its buffers from job to job.
+ */
+
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "twpdf.h"
+#include "document.h"
+#include "stralloc.h"
+#include "arg.h"
+#include "raw.h"
+#include "twerror.h"
+
+#define MAX_JOB_ARGS 32
+
+struct job {
+  const char *input_fname, *output_fname;
+  struct raw_options opts;
+};
+
+static void parse_job(struct job *job, int argc, char **argv, int line_num);
+static void read_manifest(FILE *file);
+static struct job *take_job(void);
+static void count_failure(void);
+static void run_job(struct raw_context *ctx, struct job *job);
+static void *worker(void *arg);
+
+static struct stralloc stralloc;
+static struct job *jobs;
+static int job_allocated, job_count;
+
+static pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int next_job;
+static int failed_jobs;
+
+static void
+parse_job(struct job *job, int argc, char **argv, int line_num)
+{
+  int c, positional;
+  job->input_fname = job->output_fname = NULL;
+  raw_default_options(&job->opts);
+  positional = 0;
+  reset_opt();
+  while ( (c = next_opt(argc, argv, RAW_OPT_STRING)) != -1) {
+    if (c != 0) {
+      if (raw_set_opt(&job->opts, c) < 0)
+        exit(1);
+      continue;
+    }
+    if (positional == 0)
+      job->input_fname = opt_arg_string;
+    else if (positional == 1)
+      job->output_fname = opt_arg_string;
+    positional++;
+  }
+  if (positional != 2) {
+    fprintf(stderr, "Manifest line %d: expected input and output file.\n",
+        line_num);
+    exit(1);
+  }
+}
+
+static void
+read_manifest(FILE *file)
+{
+  char *line, *args[MAX_JOB_ARGS + 1];
+  size_t line_allocated;
+  int argc, line_num;
+  line = NULL;
+  line_allocated = 0;
+  line_num = 0;
+  args[0] = "manifest";
+  while (getline(&line, &line_allocated, file) != -1) {
+    line_num++;
+    argc = split_args(stralloc_alloc(&stralloc, line), args, MAX_JOB_ARGS);
+    if (argc == -1) {
+      fprintf(stderr, "Manifest line %d: invalid arguments.\n", line_num);
+      exit(1);
+    }
+    if (argc == 1)
+      continue;
+    if (job_count == job_allocated) {
+      job_allocated += 256;
+      jobs = xrealloc(jobs, job_allocated * sizeof(struct job));
+    }
+    parse_job(&jobs[job_count++], argc, args, line_num);
+  }
+  free(line);
+}
+
+static struct job *
+take_job(void)
+{
+  struct job *job;
+  pthread_mutex_lock(&job_mutex);
+  job = next_job < job_count ? &jobs[next_job++] : NULL;
+  pthread_mutex_unlock(&job_mutex);
+  return job;
+}
+
+static void
+count_failure(void)
+{
+  pthread_mutex_lock(&job_mutex);
+  failed_jobs++;
+  pthread_mutex_unlock(&job_mutex);
+}
+
+static void
+run_job(struct raw_context *ctx, struct job *job)
+{
+  struct document doc;
+  struct tw_trap trap;
+  FILE *volatile file;
+  file = fopen(job->input_fname, "r");
+  if (file == NULL) {
+    fprintf(stderr, "Failed to open input file %s.\n", job->input_fname);
+    count_failure();
+    return;
+  }
+  raw_reset_context(ctx);
+  ctx->opts = job->opts;
+  raw_init_document(ctx, &doc);
+  tw_push_trap(&trap);
+  if (setjmp(trap.env)) {
+    /* A failed job is counted, and the other workers carry on. */
+    fprintf(stderr, "%s\n", trap.message);
+    if (file)
+      fclose(file);
+    free_document(&doc);
+    count_failure();
+    return;
+  }
+  raw_read_file(ctx, &doc, file);
+  fclose(file);
+  file = NULL;
+
+  optimise_breaks(&doc);
+  build_document(&doc);
+  pdf_write(&doc.pdf, job->output_fname);
+  tw_pop_trap(&trap);
+  free_document(&doc);
+}
+
+static void *
+worker(void *arg)
+{
+  struct raw_context ctx;
+  struct job *job;
+  raw_init_context(&ctx);
+  while ( (job = take_job()) )
+    run_job(&ctx, job);
+  raw_free_context(&ctx);
+  return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+  pthread_t *threads;
+  const char *manifest_fname;
+  FILE *manifest;
+  int c, i, thread_count;
+
+  thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+  manifest_fname = NULL;
+  while ( (c = next_opt(argc, argv, "j#")) != -1) {
+    switch (c) {
+    case 'j':
+      thread_count = opt_arg_int;
+      break;
+    case 0:
+      manifest_fname = opt_arg_string;
+      break;
+    }
+  }
+  if (thread_count < 1)
+    thread_count = 1;
+
+  stralloc_init(&stralloc);
+  if (manifest_fname) {
+    manifest = fopen(manifest_fname, "r");
+    if (manifest == NULL) {
+      fprintf(stderr, "Failed to open manifest %s.\n", manifest_fname);
+      exit(1);
+    }
+    read_manifest(manifest);
+    fclose(manifest);
+  } else {
+    read_manifest(stdin);
+  }
+
+  if (thread_count > job_count)
+    thread_count = job_count > 0 ? job_count : 1;
+  threads = xmalloc(thread_count * sizeof(pthread_t));
+  for (i = 0; i < thread_count; i++)
+    if (pthread_create(&threads[i], NULL, worker, NULL)) {
+      fprintf(stderr, "Failed to create worker thread.\n");
+      exit(1);
+    }
+  for (i = 0; i < thread_count; i++)
+    pthread_join(threads[i], NULL);
+
+  free(threads);
+  free(jobs);
+  stralloc_free(&stralloc);
+  return failed_jobs ? 1 : 0;
+}
@@ -4,6 +4,7 @@
  */
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -14,110 +15,200 @@
 #include "document.h"
 #include "stralloc.h"
 #include "arg.h"
-
-static int read_line(FILE *file, char **line, int *allocated);
-static void read_file(struct document *doc, FILE *file);
-
-struct stralloc stralloc;
-
-static int font_size;
-static int top_margin;
-static int bot_margin;
-static int left_margin;
-static const char *tab_expand;
-
-static int
-read_line(FILE *file, char **line, int *allocated)
-{
-  int c, len, i;
-  len = 0;
-  while ( (c = fgetc(file)) != EOF) {
-    if (len + 64 >= *allocated) {
-      *allocated += 256;
-      *line = xrealloc(*line, *allocated);
-    }
-    switch (c) {
-    case '\r':
-      break;
-    case '\n':
-      (*line)[len] = '\0';
-      return 1;
-    case '\t':
-      for (i = 0; tab_expand[i] != '\0'; i++)
-        (*line)[len++] = tab_expand[i];
-      break;
-    default:
-      (*line)[len++] = c;
-    }
-  }
-  (*line)[len] = '\0';
-  return 0;
-}
-
-static void
-read_file(struct document *doc, FILE *file)
-{
-  char *line, *str;
-  int line_allocated;
-
-  line_allocated = 256;
-  line = xmalloc(line_allocated);
-  while (read_line(stdin, &line, &line_allocated)) {
-    str = stralloc_alloc(&stralloc, line);
-    put_text(doc, str, font_size);
-    put_glue(doc, 0, 0);
-  }
-  free(line);
-}
+#include "raw.h"
+#include "shard.h"
+#include "pipeline.h"
+#include "sha256.h"
+#include "cache.h"
 
 int
 main(int argc, char **argv)
 {
+  struct raw_context ctx;
   struct document doc;
-  const char *output_fname;
-  int c;
+  struct pdf_base base;
+  struct cache cache;
+  struct pdf_stats stats;
+  const char *output_fname, *pdf_fname, *cache_dir, *stats_fname;
+  char *input_bytes;
+  long input_length;
+  FILE *input;
+  int c, pages_per_shard, linearize, append, pipelined, lookahead, penalty;
+  long memory_budget, max_bytes;
+  const char *encoding;
 
-  font_size = 9;
-  top_margin = 40;
-  bot_margin = 40;
-  left_margin = 80;
-  tab_expand = "    ";
+  raw_init_context(&ctx);
   output_fname = "output.pdf";
-  while ( (c = next_opt(argc, argv, "s#v#h#t*o*")) != -1) {
+  pages_per_shard = 0;
+  linearize = 0;
+  append = 0;
+  pipelined = 0;
+  lookahead = 0;
+  memory_budget = 0;
+  max_bytes = 0;
+  encoding = "hex";
+  cache_dir = NULL;
+  stats_fname = NULL;
+  while ( (c = next_opt(argc, argv, RAW_OPT_STRING "o*S#m#LapM#l#e*c*r*")) != -1) {
     switch (c) {
-    case 's':
-      font_size = opt_arg_int;
+    case 'o':
+      output_fname = opt_arg_string;
+      break;
+    case 'S':
+      pages_per_shard = opt_arg_int;
+      break;
+    case 'm':
+      max_bytes = opt_arg_int;
+      break;
+    case 'L':
+      linearize = 1;
       break;
-    case 'v':
-      top_margin = opt_arg_int;
-      bot_margin = opt_arg_int;
+    case 'a':
+      append = 1;
       break;
-    case 'h':
-      left_margin = opt_arg_int;
+    case 'p':
+      pipelined = 1;
       break;
-    case 't':
-      tab_expand = opt_arg_string;
-      if (strlen(tab_expand) > 32) {
-        fprintf(stderr, "Tab expand too long.\n");
+    case 'M':
+      memory_budget = opt_arg_int;
+      break;
+    case 'l':
+      /* 0 would mean waiting for the optimum, as -p does. */
+      if ( (lookahead = opt_arg_int) < 1) {
+        fprintf(stderr, "Lookahead must be at least one page.\n");
         exit(1);
       }
+      pipelined = 1;
       break;
-    case 'o':
-      output_fname = opt_arg_string;
+    case 'e':
+      encoding = opt_arg_string;
       break;
+    case 'c':
+      cache_dir = opt_arg_string;
+      break;
+    case 'r':
+      stats_fname = opt_arg_string;
+      break;
+    default:
+      if (raw_set_opt(&ctx.opts, c) < 0)
+        exit(1);
     }
   }
 
-  stralloc_init(&stralloc);
-  init_document(&doc, top_margin, bot_margin, left_margin);
+  if (append && (linearize || pages_per_shard)) {
+    fprintf(stderr, "Appending can't be combined with -L or -S.\n");
+    exit(1);
+  }
+  if (pipelined && (linearize || pages_per_shard || append)) {
+    fprintf(stderr, "-p and -l can't be combined with -L, -S or -a.\n");
+    exit(1);
+  }
+  if (strcmp(encoding, "hex") != 0 && strcmp(encoding, "a85") != 0) {
+    fprintf(stderr, "Unknown stream encoding %s, expected hex or a85.\n",
+        encoding);
+    exit(1);
+  }
+  if (cache_dir && (append || pages_per_shard)) {
+    fprintf(stderr, "Caching can't be combined with -a or -S.\n");
+    exit(1);
+  }
+  if (stats_fname && (cache_dir || pages_per_shard)) {
+    fprintf(stderr, "-r can't be combined with -c or -S.\n");
+    exit(1);
+  }
+  if (stats_fname && strcmp(stats_fname, "-") == 0
+      && strcmp(output_fname, "-") == 0) {
+    fprintf(stderr, "The PDF and -r can't both go to standard output.\n");
+    exit(1);
+  }
+  if (max_bytes && (pages_per_shard || linearize || append || pipelined
+        || cache_dir || stats_fname)) {
+    fprintf(stderr, "-m can't be combined with -S, -L, -a, -p, -l, -c or -r.\n");
+    exit(1);
+  }
+  if (strcmp(output_fname, "-") == 0
+      && (append || pages_per_shard || max_bytes)) {
+    fprintf(stderr, "Writing to standard output can't be combined with -a, -S or -m.\n");
+    exit(1);
+  }
 
-  read_file(&doc, stdin);
+  input = stdin;
+  pdf_fname = output_fname;
+  if (cache_dir) {
+    input_bytes = cache_read_input(stdin, &input_length);
+    if ( (input = fmemopen(input_bytes, input_length, "r")) == NULL) {
+      perror("fmemopen");
+      exit(1);
+    }
+    cache_init(&cache, cache_dir);
+    cache_add_string(&cache, VERSION);
+    cache_add(&cache, input_bytes, input_length);
+    cache_add_int(&cache, linearize);
+    cache_add_int(&cache, pipelined);
+    cache_add_int(&cache, lookahead);
+    cache_add_string(&cache, encoding);
+    raw_add_cache_key(&ctx, &cache, input);
+    rewind(input);
+    if (cache_lookup(&cache)) {
+      cache_copy(&cache, output_fname);
+      cache_free(&cache);
+      fclose(input);
+      free(input_bytes);
+      raw_free_context(&ctx);
+      return 0;
+    }
+    pdf_fname = cache_begin_store(&cache);
+  }
 
-  optimise_breaks(&doc);
-  build_document(&doc);
-  pdf_write(&doc.pdf, output_fname);
+  raw_init_document(&ctx, &doc);
+  doc.pdf.linearize = linearize;
+  doc.pdf.memory_budget = memory_budget;
+  doc.pdf.ascii85 = strcmp(encoding, "a85") == 0;
+  if (stats_fname) {
+    pdf_stats_init(&stats);
+    doc.pdf.stats = &stats;
+  }
+  if (append)
+    pdf_read_base(&doc.pdf, &base, output_fname);
+
+  if (pipelined) {
+    penalty = write_pipelined(&ctx, &doc, input, pdf_fname, lookahead);
+    if (lookahead)
+      fprintf(stderr, "Break penalty %d, optimal %d.\n", penalty,
+          optimal_penalty(&doc));
+  } else if (pages_per_shard) {
+    raw_read_file(&ctx, &doc, stdin);
+    optimise_breaks(&doc);
+    write_shards(&doc, pages_per_shard, output_fname);
+  } else if (max_bytes) {
+    raw_read_file(&ctx, &doc, stdin);
+    optimise_breaks(&doc);
+    write_bounded_shards(&doc, max_bytes, output_fname);
+  } else if (linearize || append) {
+    raw_read_file(&ctx, &doc, input);
+    optimise_breaks(&doc);
+    build_document(&doc);
+    pdf_write(&doc.pdf, pdf_fname);
+  } else {
+    raw_read_file(&ctx, &doc, input);
+    optimise_breaks(&doc);
+    write_document(&doc, pdf_fname);
+  }
 
+  if (stats_fname) {
+    pdf_stats_write(&stats, stats_fname);
+    pdf_stats_free(&stats);
+  }
   free_document(&doc);
-  stralloc_free(&stralloc);
+  if (append)
+    pdf_free_base(&base);
+  if (cache_dir) {
+    cache_end_store(&cache);
+    cache_copy(&cache, output_fname);
+    cache_free(&cache);
+    fclose(input);
+    free(input_bytes);
+  }
+  raw_free_context(&ctx);
   return 0;
 }
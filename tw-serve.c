@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2023 Christopher Lang
+ * See LICENSE for license details.
+ */
+
+/*
+ * Render PDFs for clients of a Unix domain socket.
+ *
+ * A client connects and sends one header line of tw-raw options, with -i
+ * added to read lines the way tw-image does:
+ *
+ *   -s 8 -t "  "
+ *
+ * followed by the text to render. Once the client shuts down its side of the
+ * connection the PDF is written back and the connection is closed. An empty
+ * header line gives the defaults. A job that fails, such as one naming a
+ * missing image, is closed with nothing written back and its error is printed
+ * by the server, which goes on serving the others.
+ *
+ * Worker threads each serve one connection at a time, keeping their buffers
+ * between jobs. Loaded JPEG files are shared between all workers.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "typewriter.h"
+#include "twerror.h"
+#include "twpdf.h"
+#include "twjpeg.h"
+#include "document.h"
+#include "stralloc.h"
+#include "arg.h"
+#include "raw.h"
+
+#define MAX_HEADER_ARGS 32
+
+static int parse_header(struct raw_options *opts, char *header);
+static void serve(struct raw_context *ctx, int fd);
+static void *worker(void *arg);
+
+static int listen_fd;
+static struct pdf_jpeg_cache jpeg_cache;
+
+static int
+parse_header(struct raw_options *opts, char *header)
+{
+  char *args[MAX_HEADER_ARGS + 1];
+  int argc, c, ret;
+  raw_default_options(opts);
+  args[0] = "header";
+  if ( (argc = split_args(header, args, MAX_HEADER_ARGS)) == -1)
+    return -1;
+  ret = 0;
+  reset_opt();
+  while (ret == 0
+      && (c = try_next_opt(argc, args, RAW_OPT_STRING "i")) != -1) {
+    if (c == 'i')
+      opts->images = 1;
+    else if (c == 0 || c == '?' || raw_set_opt(opts, c) <= 0)
+      ret = -1;
+  }
+  return ret;
+}
+
+static void
+serve(struct raw_context *ctx, int fd)
+{
+  struct document doc;
+  struct pdf_sink sink;
+  struct tw_trap trap;
+  FILE *in;
+  char *header;
+  size_t header_allocated;
+
+  in = fdopen(fd, "r");
+  if (in == NULL) {
+    close(fd);
+    return;
+  }
+  header = NULL;
+  header_allocated = 0;
+  if (getline(&header, &header_allocated, in) == -1) {
+    fprintf(stderr, "Connection closed before job header.\n");
+    goto done;
+  }
+  if (parse_header(&ctx->opts, header)) {
+    fprintf(stderr, "Invalid job header.\n");
+    goto done;
+  }
+
+  raw_reset_context(ctx);
+  raw_init_document(ctx, &doc);
+  tw_push_trap(&trap);
+  if (setjmp(trap.env)) {
+    /*
+     * A bad job, such as one naming a broken image or whose client went
+     * away, only loses its own connection.
+     */
+    fprintf(stderr, "%s\n", trap.message);
+    goto discard;
+  }
+  raw_read_file(ctx, &doc, in);
+  optimise_breaks(&doc);
+  build_document(&doc);
+  /* The writer counts its own offsets, so the PDF goes straight out. */
+  pdf_sink_fd(&sink, fd);
+  pdf_write_sink(&doc.pdf, &sink);
+  tw_pop_trap(&trap);
+discard:
+  free_document(&doc);
+done:
+  free(header);
+  fclose(in);
+}
+
+static void *
+worker(void *arg)
+{
+  struct raw_context ctx;
+  int fd;
+  raw_init_context(&ctx);
+  ctx.jpeg_cache = &jpeg_cache;
+  for (;;) {
+    fd = accept(listen_fd, NULL, NULL);
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      perror("accept");
+      exit(1);
+    }
+    serve(&ctx, fd);
+  }
+  return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+  struct sockaddr_un addr;
+  pthread_t thread;
+  const char *socket_path;
+  int c, i, thread_count;
+
+  thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+  socket_path = NULL;
+  while ( (c = next_opt(argc, argv, "j#")) != -1) {
+    switch (c) {
+    case 'j':
+      thread_count = opt_arg_int;
+      break;
+    case 0:
+      socket_path = opt_arg_string;
+      break;
+    }
+  }
+  if (socket_path == NULL) {
+    fprintf(stderr, "Usage: tw-serve [-j threads] socket\n");
+    exit(1);
+  }
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long %s.\n", socket_path);
+    exit(1);
+  }
+  if (thread_count < 1)
+    thread_count = 1;
+
+  signal(SIGPIPE, SIG_IGN);
+  pdf_jpeg_cache_init(&jpeg_cache);
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd == -1) {
+    perror("socket");
+    exit(1);
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path);
+  unlink(socket_path);
+  if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    perror("bind");
+    exit(1);
+  }
+  if (listen(listen_fd, 64)) {
+    perror("listen");
+    exit(1);
+  }
+
+  for (i = 1; i < thread_count; i++)
+    if (pthread_create(&thread, NULL, worker, NULL)) {
+      fprintf(stderr, "Failed to create worker thread.\n");
+      exit(1);
+    }
+  worker(NULL);
+  return 0;
+}
@@ -5,30 +5,144 @@
 
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
 
 #include "utils.h"
 #include "twpdf.h"
 #include "twcontent.h"
+#include "twescape.h"
 
-static void write_content(struct pdf_content *content, const char *format, ...);
+static void reserve(struct pdf_content *content, long size);
+static void write_bytes(struct pdf_content *content, const char *bytes, long size);
+static void write_string(struct pdf_content *content, const char *string);
+static void write_char(struct pdf_content *content, char c);
+static void write_int(struct pdf_content *content, int n);
+static int move_to_line(struct pdf_content *content, int x, int y);
+static struct pdf_obj_dictionary *create_font_resources(struct pdf *pdf);
+
+#define STREAM_PIECES(filter) { \
+  PDF_PIECE("<< /Length1 "), \
+  PDF_PIECE("\n/Length "), \
+  PDF_PIECE("\n/Filter [/" filter "]\n>>"), \
+}
+
+static const struct pdf_template_piece hex_stream_pieces[] =
+  STREAM_PIECES("ASCIIHexDecode");
+static const struct pdf_template_piece a85_stream_pieces[] =
+  STREAM_PIECES("ASCII85Decode");
+static const enum pdf_hole_type stream_holes[] = {
+  PDF_HOLE_INTEGER, PDF_HOLE_INTEGER,
+};
+static const char *const stream_keys[] = { "Length1", "Length" };
+static const struct pdf_template hex_stream_template = {
+  2, hex_stream_pieces, stream_holes, stream_keys,
+  PDF_KIND_CONTENT,
+};
+static const struct pdf_template a85_stream_template = {
+  2, a85_stream_pieces, stream_holes, stream_keys,
+  PDF_KIND_CONTENT,
+};
+
+/* A form showing text, whose resources are shared by every such form. */
+#define TEXT_FORM_PIECES(filter) { \
+  PDF_PIECE("<< /Length1 "), \
+  PDF_PIECE("\n/Length "), \
+  PDF_PIECE("\n/Filter [/" filter "]\n/Subtype /Form\n/Type /XObject\n" \
+      "/BBox ["), \
+  PDF_PIECE("\n"), \
+  PDF_PIECE("\n"), \
+  PDF_PIECE("\n"), \
+  PDF_PIECE("]\n/Resources "), \
+  PDF_PIECE("\n>>"), \
+}
+
+static const struct pdf_template_piece hex_text_form_pieces[] =
+  TEXT_FORM_PIECES("ASCIIHexDecode");
+static const struct pdf_template_piece a85_text_form_pieces[] =
+  TEXT_FORM_PIECES("ASCII85Decode");
+static const enum pdf_hole_type text_form_holes[] = {
+  PDF_HOLE_INTEGER, PDF_HOLE_INTEGER,
+  PDF_HOLE_INTEGER, PDF_HOLE_INTEGER, PDF_HOLE_INTEGER, PDF_HOLE_INTEGER,
+  PDF_HOLE_REFERENCE,
+};
+static const char *const text_form_keys[] = {
+  "Length1", "Length", "BBox", "BBox", "BBox", "BBox", "Resources",
+};
+static const struct pdf_template hex_text_form_template = {
+  7, hex_text_form_pieces, text_form_holes, text_form_keys,
+  PDF_KIND_FORM,
+};
+static const struct pdf_template a85_text_form_template = {
+  7, a85_text_form_pieces, text_form_holes, text_form_keys,
+  PDF_KIND_FORM,
+};
+
+/* Make room for size more bytes, growing geometrically. */
+static void
+reserve(struct pdf_content *content, long size)
+{
+  if (content->length + size <= content->allocated)
+    return;
+  do
+    content->allocated *= 2;
+  while (content->length + size > content->allocated);
+  content->bytes = xrealloc(content->bytes, content->allocated);
+}
+
+static void
+write_bytes(struct pdf_content *content, const char *bytes, long size)
+{
+  reserve(content, size);
+  memcpy(content->bytes + content->length, bytes, size);
+  content->length += size;
+}
+
+static void
+write_string(struct pdf_content *content, const char *string)
+{
+  write_bytes(content, string, strlen(string));
+}
 
 static void
-write_content(struct pdf_content *content, const char *format, ...)
+write_char(struct pdf_content *content, char c)
 {
-  va_list args;
-  va_start(args, format);
-  revsprintf(&content->bytes, &content->allocated, &content->length, format, args);
-  va_end(args);
+  reserve(content, 1);
+  content->bytes[content->length++] = c;
+}
+
+/* Write n followed by a space, as operands always are. */
+static void
+write_int(struct pdf_content *content, int n)
+{
+  char digits[12];
+  unsigned int u;
+  int i;
+  u = n < 0 ? -(unsigned int)n : (unsigned int)n;
+  i = sizeof(digits);
+  digits[--i] = ' ';
+  do {
+    digits[--i] = '0' + u % 10;
+    u /= 10;
+  } while (u);
+  if (n < 0)
+    digits[--i] = '-';
+  write_bytes(content, digits + i, sizeof(digits) - i);
 }
 
 static void
 switch_mode(struct pdf_content *content, int mode)
 {
   if (content->mode == PDF_CONTENT_MODE_PAGE && mode == PDF_CONTENT_MODE_TEXT) {
-    write_content(content, "BT\n");
-    write_content(content, "/F0 %d Tf\n", content->font_size);
+    write_string(content, "BT\n");
+    if (content->font_size) {
+      write_string(content, "/F0 ");
+      write_int(content, content->font_size);
+      write_string(content, "Tf\n");
+    }
   } else if (content->mode == PDF_CONTENT_MODE_TEXT && mode == PDF_CONTENT_MODE_PAGE) {
-    write_content(content, "ET\n");
+    write_string(content, "ET\n");
+    content->has_line = 0;
   }
   content->mode = mode;
 }
@@ -37,11 +151,54 @@ static void
 switch_font_size(struct pdf_content *content, int size) {
   if (content->font_size != size) {
     content->font_size = size;
-    if (content->mode == PDF_CONTENT_MODE_TEXT)
-      write_content(content, "/F0 %d Tf\n", content->font_size);
+    if (content->mode == PDF_CONTENT_MODE_TEXT) {
+      write_string(content, "/F0 ");
+      write_int(content, content->font_size);
+      write_string(content, "Tf\n");
+    }
   }
 }
 
+/*
+ * Move to the start of a new text line at x, y and return 1 if the move is
+ * left to the ' operator, which uses the leading. A new text object starts
+ * from the identity matrix, so Td can always be used instead of Tm. The
+ * leading is set once the same vertical step is seen twice in a row.
+ */
+static int
+move_to_line(struct pdf_content *content, int x, int y)
+{
+  int dy;
+  if (!content->has_line) {
+    content->has_line = 1;
+    content->line_x = x;
+    content->line_y = y;
+    write_int(content, x);
+    write_int(content, y);
+    write_string(content, "Td\n");
+    return 0;
+  }
+  dy = content->line_y - y;
+  content->line_y = y;
+  if (x == content->line_x && dy > 0) {
+    if (dy != content->leading && dy == content->last_dy) {
+      content->leading = dy;
+      write_int(content, dy);
+      write_string(content, "TL\n");
+    }
+    content->last_dy = dy;
+    if (dy == content->leading)
+      return 1;
+  } else {
+    content->last_dy = 0;
+  }
+  write_int(content, x - content->line_x);
+  write_int(content, -dy);
+  write_string(content, "Td\n");
+  content->line_x = x;
+  return 0;
+}
+
 /*
  * TODO: It doesent really make sense that this file and twwrite.c both
  * implement pdf object serialization.
@@ -49,48 +206,40 @@ switch_font_size(struct pdf_content *content, int size) {
  */
 
 static void
-escaped_string(struct pdf_content *content, const char *string)
-{
-  write_content(content, "(");
-  for (; *string; string++) switch (*string) {
-  case '(':
-  case ')':
-  case '\\':
-    write_content(content, "\\");
-  default:
-    write_content(content, "%c", *string);
+escaped_string(struct pdf_content *content, const char *string, long length)
+{
+  long run;
+  write_char(content, '(');
+  for (;;) {
+    run = pdf_string_run(string, length);
+    write_bytes(content, string, run);
+    if (run == length)
+      break;
+    write_char(content, '\\');
+    write_char(content, string[run]);
+    string += run + 1;
+    length -= run + 1;
   }
-  write_content(content, ")");
+  write_char(content, ')');
 }
 
 static void
 escaped_name(struct pdf_content *content, const char *string)
 {
-  const unsigned char *c;
-  write_content(content, "/");
-  for (c = (const unsigned char *)string; *c; c++) {
-    switch (*c) {
-    case '\t':
-    case '\n':
-    case '\f':
-    case '\r':
-    case ' ':
-    case '(':
-    case ')':
-    case '<':
-    case '>':
-    case '[':
-    case ']':
-    case '{':
-    case '}':
-    case '/':
-    case '%':
-    case '#':
-      write_content(content, "#%02x", *c);
+  static const char hex[] = "0123456789abcdef";
+  long run, length;
+  unsigned char c;
+  write_char(content, '/');
+  for (length = strlen(string); ; length -= run + 1) {
+    run = pdf_name_run(string, length);
+    write_bytes(content, string, run);
+    if (run == length)
       break;
-    default:
-      write_content(content, "%c", *c);
-    }
+    c = string[run];
+    write_char(content, '#');
+    write_char(content, hex[c >> 4]);
+    write_char(content, hex[c & 0xf]);
+    string += run + 1;
   }
 }
 
@@ -98,20 +247,26 @@ escaped_name(struct pdf_content *content, const char *string)
 void
 pdf_content_init(struct pdf_content *content)
 {
-  content->allocated = 1024;
+  content->allocated = 4096;
   content->length = 0;
   content->bytes = xmalloc(content->allocated);
   content->mode = PDF_CONTENT_MODE_PAGE;
+  content->font_size = 0;
+  content->has_line = 0;
+  content->leading = 0;
+  content->last_dy = 0;
 }
 
+/* Start a new page, keeping the buffer of the last one. */
 void
 pdf_content_reset_page(struct pdf_content *content)
 {
-  free(content->bytes);
-  content->allocated = 1024;
   content->length = 0;
-  content->bytes = xmalloc(content->allocated);
   content->mode = PDF_CONTENT_MODE_PAGE;
+  content->font_size = 0;
+  content->has_line = 0;
+  content->leading = 0;
+  content->last_dy = 0;
 }
 
 void
@@ -121,14 +276,15 @@ pdf_content_free(struct pdf_content *content)
 }
 
 void
-pdf_content_write_text(struct pdf_content *content, const char *string, int x,
-    int y, int size)
+pdf_content_write_text(struct pdf_content *content, const char *string,
+    int length, int x, int y, int size)
 {
+  int next_line;
   switch_mode(content, PDF_CONTENT_MODE_TEXT);
   switch_font_size(content, size);
-  write_content(content, "1 0 0 1 %d %d Tm\n", x, y);
-  escaped_string(content, string);
-  write_content(content, " Tj\n");
+  next_line = move_to_line(content, x, y);
+  escaped_string(content, string, length);
+  write_string(content, next_line ? " '\n" : " Tj\n");
 }
 
 void
@@ -136,28 +292,89 @@ pdf_content_write_image(struct pdf_content *content, const char *name, int x,
     int y, int w, int h)
 {
   switch_mode(content, PDF_CONTENT_MODE_PAGE);
-  write_content(content, "q\n");
-  write_content(content, "%d 0 0 %d %d %d cm\n", w, h, x, y);
+  write_string(content, "q\n");
+  write_int(content, w);
+  write_string(content, "0 0 ");
+  write_int(content, h);
+  write_int(content, x);
+  write_int(content, y);
+  write_string(content, "cm\n");
   escaped_name(content, name);
-  write_content(content, " Do\n", name);
-  write_content(content, "Q\n");
+  write_string(content, " Do\n");
+  write_string(content, "Q\n");
+}
+
+/* Place a form defined by pdf_content_define_text_form at x, y. */
+void
+pdf_content_write_form(struct pdf_content *content, const char *name, int x,
+    int y)
+{
+  switch_mode(content, PDF_CONTENT_MODE_PAGE);
+  write_string(content, "q\n1 0 0 1 ");
+  write_int(content, x);
+  write_int(content, y);
+  write_string(content, "cm\n");
+  escaped_name(content, name);
+  write_string(content, " Do\n");
+  write_string(content, "Q\n");
 }
 
 void
 pdf_content_define(struct pdf *pdf, struct pdf_obj_indirect *ref,
     struct pdf_content *content)
 {
+  char *bytes;
+  int values[2];
   switch_mode(content, PDF_CONTENT_MODE_PAGE);
-  pdf_define_stream(pdf, ref, pdf_create_dictionary(pdf),
-      pdf_create_array(pdf), content->length, content->bytes);
-  content->bytes = NULL; /* Pass ownership to pdf. */
+  /* The pdf gets a copy so the buffer can be reused for the next page. */
+  bytes = xmalloc(content->length);
+  memcpy(bytes, content->bytes, content->length);
+  values[0] = content->length;
+  values[1] = pdf_encoded_length(pdf->ascii85, content->length);
+  pdf_define_template_stream(pdf, ref, pdf_create_template(pdf,
+        pdf->ascii85 ? &a85_stream_template : &hex_stream_template, values),
+      content->length, bytes);
 }
 
-struct pdf_obj *
-pdf_content_create_resources(struct pdf *pdf,
-    struct pdf_obj_dictionary *xobjects)
+/*
+ * Define a form showing one line of text with its baseline at the origin.
+ * resources must refer to resources made by pdf_content_create_form_resources.
+ */
+void
+pdf_content_define_text_form(struct pdf *pdf, struct pdf_obj_indirect *ref,
+    struct pdf_obj_indirect *resources, const char *string, int length,
+    int size)
 {
-  struct pdf_obj_dictionary *resources, *font_resources, *helvetica;
+  struct pdf_content content;
+  char *bytes;
+  int values[7];
+  pdf_content_init(&content);
+  switch_font_size(&content, size);
+  switch_mode(&content, PDF_CONTENT_MODE_TEXT);
+  escaped_string(&content, string, length);
+  write_string(&content, " Tj\n");
+  switch_mode(&content, PDF_CONTENT_MODE_PAGE);
+  bytes = xmalloc(content.length);
+  memcpy(bytes, content.bytes, content.length);
+  values[0] = content.length;
+  values[1] = pdf_encoded_length(pdf->ascii85, content.length);
+  /* Courier glyphs are 0.6 em wide and stay within an em of the baseline. */
+  values[2] = -size;
+  values[3] = -size;
+  values[4] = length * size * 3 / 5 + size;
+  values[5] = 2 * size;
+  values[6] = resources->obj_num;
+  pdf_define_template_stream(pdf, ref, pdf_create_template(pdf,
+        pdf->ascii85 ? &a85_text_form_template : &hex_text_form_template,
+        values),
+      content.length, bytes);
+  pdf_content_free(&content);
+}
+
+static struct pdf_obj_dictionary *
+create_font_resources(struct pdf *pdf)
+{
+  struct pdf_obj_dictionary *font_resources, *helvetica;
   helvetica = pdf_create_dictionary(pdf);
   helvetica = pdf_prepend_dictionary(pdf, helvetica, "Type",
       (struct pdf_obj *)pdf_create_name(pdf, "Font"));
@@ -165,13 +382,44 @@ pdf_content_create_resources(struct pdf *pdf,
       (struct pdf_obj *)pdf_create_name(pdf, "Type1"));
   helvetica = pdf_prepend_dictionary(pdf, helvetica, "BaseFont",
       (struct pdf_obj *)pdf_create_name(pdf, "Courier"));
+  helvetica = pdf_prepend_dictionary(pdf, helvetica, "Encoding",
+      (struct pdf_obj *)pdf_create_name(pdf, "WinAnsiEncoding"));
   font_resources = pdf_create_dictionary(pdf);
   font_resources = pdf_prepend_dictionary(pdf, font_resources, "F0",
       (struct pdf_obj *)helvetica);
+  return font_resources;
+}
+
+struct pdf_obj *
+pdf_content_create_resources(struct pdf *pdf,
+    struct pdf_obj_dictionary *xobjects)
+{
+  struct pdf_obj_dictionary *resources;
   resources = pdf_create_dictionary(pdf);
   resources = pdf_prepend_dictionary(pdf, resources, "Font",
-      (struct pdf_obj *)font_resources);
+      (struct pdf_obj *)create_font_resources(pdf));
   resources = pdf_prepend_dictionary(pdf, resources, "XObject",
       (struct pdf_obj *)xobjects);
   return (struct pdf_obj *)resources;
 }
+
+/*
+ * At most how many bytes the resources of pdf_content_create_resources take,
+ * given the length of the XObjects. The font and the keys take under 256.
+ */
+long
+pdf_content_resources_bound(long xobjects_length)
+{
+  return xobjects_length + 256;
+}
+
+/* Resources for the forms of pdf_content_define_text_form. */
+struct pdf_obj *
+pdf_content_create_form_resources(struct pdf *pdf)
+{
+  struct pdf_obj_dictionary *resources;
+  resources = pdf_create_dictionary(pdf);
+  resources = pdf_prepend_dictionary(pdf, resources, "Font",
+      (struct pdf_obj *)create_font_resources(pdf));
+  return (struct pdf_obj *)resources;
+}
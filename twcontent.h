@@ -18,17 +18,31 @@ struct pdf_content {
   char *bytes;
   int mode;
   int font_size;
+  /*
+   * Start of the current text line, valid once a line has been written in
+   * this text object, and the leading set with TL (0 if none).
+   */
+  int has_line, line_x, line_y;
+  int leading, last_dy;
 };
 
 void pdf_content_init(struct pdf_content *content);
 void pdf_content_reset_page(struct pdf_content *content);
 void pdf_content_free(struct pdf_content *content);
 
+/* Text is shown in WinAnsiEncoding, see winansi.c. */
 void pdf_content_write_text(struct pdf_content *content, const char *string,
-    int x, int y, int size);
+    int length, int x, int y, int size);
 void pdf_content_write_image(struct pdf_content *content, const char *name,
     int x, int y, int w, int h);
+void pdf_content_write_form(struct pdf_content *content, const char *name,
+    int x, int y);
 
 void pdf_content_define(struct pdf *pdf, struct pdf_obj_indirect *ref,
     struct pdf_content *content);
+void pdf_content_define_text_form(struct pdf *pdf,
+    struct pdf_obj_indirect *ref, struct pdf_obj_indirect *resources,
+    const char *string, int length, int size);
 struct pdf_obj *pdf_content_create_resources(struct pdf *pdf, struct pdf_obj_dictionary *xobjects);
+struct pdf_obj *pdf_content_create_form_resources(struct pdf *pdf);
+long pdf_content_resources_bound(long xobjects_length);
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2023 Christopher Lang
+ * See LICENSE for license details.
+ */
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "typewriter.h"
+#include "twerror.h"
+
+static _Thread_local struct tw_trap *traps;
+
+void
+tw_push_trap(struct tw_trap *trap)
+{
+  trap->code = TW_OK;
+  trap->message[0] = '\0';
+  trap->prev = traps;
+  traps = trap;
+}
+
+/* Pop a trap that was not sprung, which must be the innermost one. */
+void
+tw_pop_trap(struct tw_trap *trap)
+{
+  traps = trap->prev;
+}
+
+void
+tw_fail(int code, const char *format, ...)
+{
+  struct tw_trap *trap;
+  va_list args;
+  va_start(args, format);
+  if ( (trap = traps) == NULL) {
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+  } else {
+    vsnprintf(trap->message, TW_MESSAGE_MAX, format, args);
+  }
+  va_end(args);
+  if (trap == NULL)
+    exit(1);
+  trap->code = code;
+  traps = trap->prev;
+  longjmp(trap->env, 1);
+}
+
+/* Pass a failure caught by trap on to the next trap out. */
+void
+tw_rethrow(struct tw_trap *trap)
+{
+  tw_fail(trap->code, "%s", trap->message);
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2023 Christopher Lang
+ * See LICENSE for license details.
+ */
+
+/*
+ * The following must be included before this file:
+#include <setjmp.h>
+#include "typewriter.h"
+ */
+
+#define TW_MESSAGE_MAX 256
+
+/*
+ * Failures, with a code from enum tw_error, unwind to the innermost trap of
+ * the calling thread. Push a trap, then call setjmp on its env; setjmp
+ * returns nonzero once a failure has unwound to it, with code and message
+ * set and the trap already popped. A thread without a trap prints the
+ * message and exits, as the tw-* programs expect. Nothing is freed on the
+ * way, so code that holds a lock or owns a resource while it can fail should
+ * trap, release it and rethrow.
+ */
+struct tw_trap {
+  jmp_buf env;
+  int code;
+  char message[TW_MESSAGE_MAX];
+  struct tw_trap *prev;
+};
+
+void tw_push_trap(struct tw_trap *trap);
+void tw_pop_trap(struct tw_trap *trap);
+void tw_fail(int code, const char *format, ...)
+  __attribute__((noreturn, format(printf, 2, 3)));
+void tw_rethrow(struct tw_trap *trap) __attribute__((noreturn));
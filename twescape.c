@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2023 Christopher Lang
+ * See LICENSE for license details.
+ */
+
+/*
+ * Finding the bytes of strings and names that must be escaped. Text rarely
+ * has any, so long runs are scanned 16 or 32 bytes at a time where the CPU
+ * can, chosen when the program starts.
+ */
+
+#include <string.h>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+#include "twescape.h"
+
+static long string_run_scalar(const char *bytes, long length);
+static long name_run_scalar(const char *bytes, long length);
+#ifdef HAVE_X86_KERNELS
+static long string_run_sse2(const char *bytes, long length);
+static long name_run_sse2(const char *bytes, long length);
+static long string_run_avx2(const char *bytes, long length);
+static long name_run_avx2(const char *bytes, long length);
+static void select_kernels(void);
+#endif
+
+static long (*string_run)(const char *, long) = string_run_scalar;
+static long (*name_run)(const char *, long) = name_run_scalar;
+
+static long
+string_run_scalar(const char *bytes, long length)
+{
+  long i;
+  for (i = 0; i < length; i++)
+    if (bytes[i] == '(' || bytes[i] == ')' || bytes[i] == '\\')
+      break;
+  return i;
+}
+
+static long
+name_run_scalar(const char *bytes, long length)
+{
+  unsigned char c;
+  long i;
+  for (i = 0; i < length; i++) {
+    c = bytes[i];
+    if (c < 0x21 || c > 0x7e || strchr("()<>[]{}/%#", c))
+      break;
+  }
+  return i;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/*
+ * Each kernel compares whole blocks with the special bytes and hands the
+ * block with the first hit, and the tail, to the scalar loop.
+ */
+static long
+string_run_sse2(const char *bytes, long length)
+{
+  __m128i x, hits;
+  long i;
+  for (i = 0; i + 16 <= length; i += 16) {
+    x = _mm_loadu_si128((const __m128i *)(bytes + i));
+    hits = _mm_or_si128(_mm_or_si128(
+        _mm_cmpeq_epi8(x, _mm_set1_epi8('(')),
+        _mm_cmpeq_epi8(x, _mm_set1_epi8(')'))),
+        _mm_cmpeq_epi8(x, _mm_set1_epi8('\\')));
+    if (_mm_movemask_epi8(hits))
+      break;
+  }
+  return i + string_run_scalar(bytes + i, length - i);
+}
+
+/* Signed bytes below 0x21 are controls, space or have the top bit set. */
+static long
+name_run_sse2(const char *bytes, long length)
+{
+  static const char delimiters[] = "()<>[]{}/%#\x7f";
+  __m128i x, hits;
+  long i;
+  int j;
+  for (i = 0; i + 16 <= length; i += 16) {
+    x = _mm_loadu_si128((const __m128i *)(bytes + i));
+    hits = _mm_cmplt_epi8(x, _mm_set1_epi8(0x21));
+    for (j = 0; delimiters[j]; j++)
+      hits = _mm_or_si128(hits,
+          _mm_cmpeq_epi8(x, _mm_set1_epi8(delimiters[j])));
+    if (_mm_movemask_epi8(hits))
+      break;
+  }
+  return i + name_run_scalar(bytes + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static long
+string_run_avx2(const char *bytes, long length)
+{
+  __m256i x, hits;
+  long i;
+  for (i = 0; i + 32 <= length; i += 32) {
+    x = _mm256_loadu_si256((const __m256i *)(bytes + i));
+    hits = _mm256_or_si256(_mm256_or_si256(
+        _mm256_cmpeq_epi8(x, _mm256_set1_epi8('(')),
+        _mm256_cmpeq_epi8(x, _mm256_set1_epi8(')'))),
+        _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\\')));
+    if (_mm256_movemask_epi8(hits))
+      break;
+  }
+  return i + string_run_sse2(bytes + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static long
+name_run_avx2(const char *bytes, long length)
+{
+  static const char delimiters[] = "()<>[]{}/%#\x7f";
+  __m256i x, hits;
+  long i;
+  int j;
+  for (i = 0; i + 32 <= length; i += 32) {
+    x = _mm256_loadu_si256((const __m256i *)(bytes + i));
+    hits = _mm256_cmpgt_epi8(_mm256_set1_epi8(0x21), x);
+    for (j = 0; delimiters[j]; j++)
+      hits = _mm256_or_si256(hits,
+          _mm256_cmpeq_epi8(x, _mm256_set1_epi8(delimiters[j])));
+    if (_mm256_movemask_epi8(hits))
+      break;
+  }
+  return i + name_run_sse2(bytes + i, length - i);
+}
+
+__attribute__((constructor))
+static void
+select_kernels(void)
+{
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    string_run = string_run_avx2;
+    name_run = name_run_avx2;
+  } else {
+    string_run = string_run_sse2;
+    name_run = name_run_sse2;
+  }
+}
+
+#endif
+
+/* The number of bytes at the start of bytes that a string can hold as is. */
+long
+pdf_string_run(const char *bytes, long length)
+{
+  return string_run(bytes, length);
+}
+
+/* Likewise for a name, outside of which bytes are written as #xx. */
+long
+pdf_name_run(const char *bytes, long length)
+{
+  return name_run(bytes, length);
+}
@@ -0,0 +1,7 @@
+/*
+ * Copyright (C) 2023 Christopher Lang
+ * See LICENSE for license details.
+ */
+
+long pdf_string_run(const char *bytes, long length);
+long pdf_name_run(const char *bytes, long length);
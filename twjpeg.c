@@ -3,150 +3,362 @@
  * See LICENSE for license details.
  */
 
-#include <stdint.h>
+#include <pthread.h>
+#include <setjmp.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 
 #include "utils.h"
+#include "typewriter.h"
+#include "twerror.h"
 #include "twpdf.h"
 #include "twjpeg.h"
 
-static uint16_t read_uint16(FILE *file);
-static void skip_segment_payload(FILE *file);
-static void read_pdf_info(FILE *file, const char *fname, struct pdf_jpeg_info *info);
+static int scan_jpeg(const unsigned char *bytes, long length,
+    const char *fname, struct pdf_jpeg_info *info);
+static char *load_jpeg(const char *fname, struct pdf_jpeg_info *info, long *length);
+static struct pdf_obj_indirect *define_jpeg(struct pdf *pdf,
+    const struct pdf_jpeg_info *info, long length, char *bytes);
+static void free_cache_entry(struct pdf_jpeg_cache_entry *entry);
+static struct pdf_jpeg_cache_entry *lookup_entry(struct pdf_jpeg_cache *cache,
+    const char *fname);
 
-static uint16_t
-read_uint16(FILE *file)
+#define PDF_JPEG_CACHE_MAX 64
+
+/* Image XObjects differ only in their size, encoding and colour space. */
+#define IMAGE_PIECES(filter, color_space) { \
+  PDF_PIECE("<< /Length1 "), \
+  PDF_PIECE("\n/Length "), \
+  PDF_PIECE("\n/Filter [/" filter "\n/DCTDecode]\n/BitsPerComponent 8\n" \
+      "/ColorSpace /" color_space "\n/Height "), \
+  PDF_PIECE("\n/Width "), \
+  PDF_PIECE("\n/Subtype /Image\n/Type /XObject\n>>"), \
+}
+
+static const struct pdf_template_piece rgb_image_pieces[] =
+  IMAGE_PIECES("ASCIIHexDecode", "DeviceRGB");
+static const struct pdf_template_piece gray_image_pieces[] =
+  IMAGE_PIECES("ASCIIHexDecode", "DeviceGray");
+static const struct pdf_template_piece a85_rgb_image_pieces[] =
+  IMAGE_PIECES("ASCII85Decode", "DeviceRGB");
+static const struct pdf_template_piece a85_gray_image_pieces[] =
+  IMAGE_PIECES("ASCII85Decode", "DeviceGray");
+static const enum pdf_hole_type image_holes[] = {
+  PDF_HOLE_INTEGER, PDF_HOLE_INTEGER, PDF_HOLE_INTEGER, PDF_HOLE_INTEGER,
+};
+static const char *const image_keys[] = {
+  "Length1", "Length", "Height", "Width",
+};
+static const struct pdf_template rgb_image_template = {
+  4, rgb_image_pieces, image_holes, image_keys,
+  PDF_KIND_IMAGE,
+};
+static const struct pdf_template gray_image_template = {
+  4, gray_image_pieces, image_holes, image_keys,
+  PDF_KIND_IMAGE,
+};
+static const struct pdf_template a85_rgb_image_template = {
+  4, a85_rgb_image_pieces, image_holes, image_keys,
+  PDF_KIND_IMAGE,
+};
+static const struct pdf_template a85_gray_image_template = {
+  4, a85_gray_image_pieces, image_holes, image_keys,
+  PDF_KIND_IMAGE,
+};
+
+/*
+ * Find the frame header in the first length bytes of a JPEG file. Returns 0
+ * if more bytes are needed. Frames of the coding processes DCTDecode decodes,
+ * baseline, extended sequential and progressive Huffman, are accepted.
+ */
+static int
+scan_jpeg(const unsigned char *bytes, long length, const char *fname,
+    struct pdf_jpeg_info *info)
 {
-  uint16_t n;
-  n = 0;
-  fread(1 + (char *)&n, 1, 1, file);
-  fread((char *)&n, 1, 1, file);
-  return n;
+  const unsigned char *segment;
+  long pos, segment_length;
+  unsigned char marker;
+
+  if (length < 2)
+    return 0;
+  if (bytes[0] != 0xff || bytes[1] != 0xd8)
+    tw_fail(TW_ERR_JPEG, "twpdf: Not a JPEG file %s.", fname);
+  for (pos = 2; ; pos += segment_length) {
+    if (pos >= length)
+      return 0;
+    if (bytes[pos] != 0xff)
+      tw_fail(TW_ERR_JPEG, "twpdf: JPEG file invalid %s.", fname);
+    /* A marker may be preceded by any number of fill bytes. */
+    while (pos < length && bytes[pos] == 0xff)
+      pos++;
+    if (pos >= length)
+      return 0;
+    marker = bytes[pos++];
+    /* TEM, RSTn and SOI stand alone, without a length. */
+    if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd8)) {
+      segment_length = 0;
+      continue;
+    }
+    switch (marker) {
+    case 0x00:
+      tw_fail(TW_ERR_JPEG, "twpdf: JPEG file invalid %s.", fname);
+    case 0xda: /* compressed image data */
+      /*
+       * If we get to the image data and have not found width and height yet
+       * then assume we will not find it.
+       */
+      tw_fail(TW_ERR_JPEG, "twpdf: JPEG image data reached and no DCT segment found in %s.", fname);
+    case 0xd9: /* end of image marker */
+      tw_fail(TW_ERR_JPEG, "twpdf: End of JPEG reached and no DCT segment found in %s.", fname);
+    }
+    if (pos + 2 > length)
+      return 0;
+    segment = bytes + pos;
+    segment_length = segment[0] << 8 | segment[1];
+    if (segment_length < 2)
+      tw_fail(TW_ERR_JPEG, "twpdf: JPEG file invalid %s.", fname);
+    /* Every other marker has a segment, skipped unless it starts a frame. */
+    if ((marker & 0xf0) != 0xc0 || marker == 0xc4 || marker == 0xc8
+        || marker == 0xcc)
+      continue;
+    if (marker != 0xc0 && marker != 0xc1 && marker != 0xc2)
+      tw_fail(TW_ERR_JPEG, "twpdf: Lossless, hierarchical and arithmetic coded JPEGs are not supported %s.", fname);
+    if (pos + 8 > length)
+      return 0;
+    if (segment[2] != 8)
+      tw_fail(TW_ERR_JPEG, "twpdf: JPEG file has unsupported precision '%d' in %s.",
+          segment[2], fname);
+    info->height = segment[3] << 8 | segment[4];
+    info->width = segment[5] << 8 | segment[6];
+    info->components = segment[7];
+    break;
+  }
+  if (info->height == 0)
+    tw_fail(TW_ERR_JPEG, "twpdf: JPEG height defined by DNL is not supported %s.", fname);
+  if (info->components != 1 && info->components != 3)
+    tw_fail(TW_ERR_JPEG, "twpdf: JPEG file has unsupported color component count '%d' in %s.",
+        info->components, fname);
+  return 1;
 }
 
-static void
-skip_segment_payload(FILE *file)
+/* The whole file is read in one go and its header scanned in memory. */
+static char *
+load_jpeg(const char *fname, struct pdf_jpeg_info *info, long *length)
 {
-  uint16_t segment_length;
-  segment_length = read_uint16(file);
-  fseek(file, segment_length - 2, SEEK_CUR);
+  struct tw_trap trap;
+  FILE *file;
+  char *volatile bytes;
+
+  file = fopen(fname, "r");
+  if (file == NULL)
+    tw_fail(TW_ERR_IO, "twpdf: Failed to open JPEG file %s.", fname);
+  bytes = NULL;
+  tw_push_trap(&trap);
+  if (setjmp(trap.env)) {
+    free(bytes);
+    fclose(file);
+    tw_rethrow(&trap);
+  }
+  fseek(file, 0, SEEK_END);
+  if ( (*length = ftell(file)) < 0)
+    tw_fail(TW_ERR_IO, "twpdf: Error reading JPEG file %s.", fname);
+  fseek(file, 0, SEEK_SET);
+  bytes = xmalloc(*length);
+  if (fread(bytes, 1, *length, file) != (size_t)*length
+      || !scan_jpeg((unsigned char *)bytes, *length, fname, info))
+    tw_fail(TW_ERR_IO, "twpdf: Error reading JPEG file %s.", fname);
+  tw_pop_trap(&trap);
+  fclose(file);
+  return bytes;
+}
+
+static struct pdf_obj_indirect *
+define_jpeg(struct pdf *pdf, const struct pdf_jpeg_info *info, long length,
+    char *bytes)
+{
+  struct pdf_obj_indirect *ref;
+  const struct pdf_template *tmpl;
+  int values[4];
+
+  if (pdf->ascii85)
+    tmpl = info->components == 3
+      ? &a85_rgb_image_template : &a85_gray_image_template;
+  else
+    tmpl = info->components == 3 ? &rgb_image_template : &gray_image_template;
+  values[0] = length;
+  values[1] = pdf_encoded_length(pdf->ascii85, length);
+  values[2] = info->height;
+  values[3] = info->width;
+  ref = pdf_allocate_indirect_obj(pdf);
+  pdf_define_template_stream(pdf, ref, pdf_create_template(pdf, tmpl, values),
+      length, bytes);
+  return ref;
 }
 
 static void
-read_pdf_info(FILE *file, const char *fname, struct pdf_jpeg_info *info)
+free_cache_entry(struct pdf_jpeg_cache_entry *entry)
 {
-  unsigned char magic_bytes[2];
-  unsigned char segment_code[2];
+  free(entry->fname);
+  free(entry->bytes);
+  free(entry);
+}
 
-  fread(magic_bytes, 1, 2, file);
-  if (magic_bytes[0] != 0xff || magic_bytes[1] != 0xd8) {
-    fprintf(stderr, "twpdf: Not a JPEG file %s.\n", fname);
-    exit(1);
-  }
+/* Find or load the entry for fname. Must be called with the mutex held. */
+static struct pdf_jpeg_cache_entry *
+lookup_entry(struct pdf_jpeg_cache *cache, const char *fname)
+{
+  struct pdf_jpeg_cache_entry *entry, **link;
+  struct pdf_jpeg_info info;
+  struct stat st;
+  long length;
+  char *bytes;
 
-  for(;;) {
-    fread(segment_code, 1, 2, file);
-    if (segment_code[0] != 0xFF) {
-      fprintf(stderr, "twpdf: JPEG file invalid %s.\n", fname);
-      exit(1);
-    }
-    if (segment_code[1] >= 0xe0 && segment_code[1] <= 0xef) {
-      /*
-       * Application specific segment.
-       * Just hope that the first two bytes specify length of this segment.
-       */
-      skip_segment_payload(file);
-    } else {
-      switch (segment_code[1]) {
-      case 0xfe: /* comment marker */
-      case 0xdb: /* quantization tables */
-      case 0xc4: /* huffman tables */
-        skip_segment_payload(file);
-        break;
-      case 0xc0: /* baseline DCT segment (contains image width and height) */
-        fseek(file, 3, SEEK_CUR);
-        info->height = read_uint16(file);
-        info->width = read_uint16(file);
-        fread(&info->components, 1, 1, file);
-        goto end_scan;
-      case 0xc2: /* progressive DCT segment (unsupported) */
-        fprintf(stderr, "twpdf: Progressive DCT JPEGs are not supported %s.\n", fname);
-        exit(1);
-      case 0xda: /* compressed image data */
-        /*
-         * If we get to the image data and have not found width and height yet
-         * then assume we will not find it.
-         */
-        fprintf(stderr, "twpdf: JPEG image data reached and no DCT segment found in %s.\n", fname);
-        exit(1);
-      case 0xd9: /* end of image marker */
-        fprintf(stderr, "twpdf: End of JPEG reached and no DCT segment found in %s.\n", fname);
-        exit(1);
-      default:
-        fprintf(stderr, "twpdf: Unrecognised JPEG segment code '%02x %02x' in %s.\n",
-            segment_code[0], segment_code[1], fname);
-        exit(1);
-      }
-    }
-    if (ferror(file) || feof(file)) {
-      fprintf(stderr, "twpdf: Error reading JPEG file %s.\n", fname);
-      exit(1);
+  if (stat(fname, &st))
+    tw_fail(TW_ERR_IO, "twpdf: Failed to open JPEG file %s.", fname);
+  for (link = &cache->entries; (entry = *link); link = &entry->next)
+    if (strcmp(entry->fname, fname) == 0)
+      break;
+  if (entry) {
+    *link = entry->next;
+    cache->entry_count--;
+    if (entry->dev != st.st_dev || entry->ino != st.st_ino
+        || entry->size != st.st_size || entry->mtime != st.st_mtime) {
+      free_cache_entry(entry);
+      entry = NULL;
     }
   }
-end_scan:
-  if (ferror(file) || feof(file)) {
-    fprintf(stderr, "twpdf: Error reading JPEG file %s.\n", fname);
-    exit(1);
+  if (entry == NULL) {
+    /* Loaded first, so a file that fails to load leaves no entry behind. */
+    bytes = load_jpeg(fname, &info, &length);
+    entry = xmalloc(sizeof(struct pdf_jpeg_cache_entry));
+    entry->fname = strdup(fname);
+    entry->dev = st.st_dev;
+    entry->ino = st.st_ino;
+    entry->size = st.st_size;
+    entry->mtime = st.st_mtime;
+    entry->info = info;
+    entry->length = length;
+    entry->bytes = bytes;
   }
-  if (info->components != 1 && info->components != 3) {
-    fprintf(stderr, "twpdf: JPEG file has unsupported color component count '%d' in %s.\n",
-        info->components, fname);
-    exit(1);
+  /* Most recently used entries are kept at the front. */
+  entry->next = cache->entries;
+  cache->entries = entry;
+  if (++cache->entry_count > PDF_JPEG_CACHE_MAX) {
+    for (link = &cache->entries; (*link)->next; link = &(*link)->next);
+    free_cache_entry(*link);
+    *link = NULL;
+    cache->entry_count--;
+  }
+  return entry;
+}
+
+/* Read only as much of the file as the header needs. */
+void
+pdf_jpeg_read_info(const char *fname, struct pdf_jpeg_info *info)
+{
+  struct tw_trap trap;
+  FILE *file;
+  unsigned char *volatile bytes;
+  long length, allocated;
+
+  file = fopen(fname, "r");
+  if (file == NULL)
+    tw_fail(TW_ERR_IO, "twpdf: Failed to open JPEG file %s.", fname);
+  bytes = NULL;
+  tw_push_trap(&trap);
+  if (setjmp(trap.env)) {
+    free(bytes);
+    fclose(file);
+    tw_rethrow(&trap);
   }
+  allocated = 4096;
+  bytes = xmalloc(allocated);
+  length = 0;
+  for (;;) {
+    length += fread(bytes + length, 1, allocated - length, file);
+    if (scan_jpeg(bytes, length, fname, info))
+      break;
+    if (length < allocated)
+      tw_fail(TW_ERR_IO, "twpdf: Error reading JPEG file %s.", fname);
+    allocated *= 2;
+    bytes = xrealloc(bytes, allocated);
+  }
+  tw_pop_trap(&trap);
+  free(bytes);
+  fclose(file);
 }
 
 struct pdf_obj_indirect *
 pdf_jpeg_define(struct pdf *pdf, const char *fname, struct pdf_jpeg_info *info)
 {
-  FILE *file;
-  struct pdf_obj_array *filters;
-  struct pdf_obj_indirect *ref;
-  struct pdf_obj_dictionary *dictionary;
-  const char *color_space;
   long length;
   char *bytes;
+  bytes = load_jpeg(fname, info, &length);
+  return define_jpeg(pdf, info, length, bytes);
+}
 
-  file = fopen(fname, "r");
-  if (file == NULL) {
-    fprintf(stderr, "twpdf: Failed to open JPEG file %s.\n", fname);
-    exit(1);
+void
+pdf_jpeg_cache_init(struct pdf_jpeg_cache *cache)
+{
+  pthread_mutex_init(&cache->mutex, NULL);
+  cache->entry_count = 0;
+  cache->entries = NULL;
+}
+
+void
+pdf_jpeg_cache_free(struct pdf_jpeg_cache *cache)
+{
+  struct pdf_jpeg_cache_entry *entry, *next_entry;
+  for (entry = cache->entries; entry; entry = next_entry) {
+    next_entry = entry->next;
+    free_cache_entry(entry);
   }
-  read_pdf_info(file, fname, info);
-  fseek(file, 0, SEEK_END);
-  length = ftell(file);
-  fseek(file, 0, SEEK_SET);
+  pthread_mutex_destroy(&cache->mutex);
+}
+
+/*
+ * The cache functions are like their plain counterparts but reuse the bytes
+ * and header of a previous load if the file has not changed since. They are
+ * safe to call from many threads.
+ */
+void
+pdf_jpeg_cache_read_info(struct pdf_jpeg_cache *cache, const char *fname,
+    struct pdf_jpeg_info *info)
+{
+  struct tw_trap trap;
+  pthread_mutex_lock(&cache->mutex);
+  tw_push_trap(&trap);
+  if (setjmp(trap.env)) {
+    pthread_mutex_unlock(&cache->mutex);
+    tw_rethrow(&trap);
+  }
+  *info = lookup_entry(cache, fname)->info;
+  tw_pop_trap(&trap);
+  pthread_mutex_unlock(&cache->mutex);
+}
+
+struct pdf_obj_indirect *
+pdf_jpeg_cache_define(struct pdf_jpeg_cache *cache, struct pdf *pdf,
+    const char *fname, struct pdf_jpeg_info *info)
+{
+  struct pdf_jpeg_cache_entry *entry;
+  struct tw_trap trap;
+  char *bytes;
+  long length;
+  pthread_mutex_lock(&cache->mutex);
+  tw_push_trap(&trap);
+  if (setjmp(trap.env)) {
+    pthread_mutex_unlock(&cache->mutex);
+    tw_rethrow(&trap);
+  }
+  entry = lookup_entry(cache, fname);
+  *info = entry->info;
+  length = entry->length;
   bytes = xmalloc(length);
-  fread(bytes, 1, length, file);
-
-  color_space = info->components == 3 ? "DeviceRGB" : "DeviceGray";
-  filters = pdf_create_array(pdf);
-  filters = pdf_prepend_array(pdf, filters,
-      (struct pdf_obj *)pdf_create_name(pdf, "DCTDecode"));
-  dictionary = pdf_create_dictionary(pdf);
-  dictionary = pdf_prepend_dictionary(pdf, dictionary, "Type",
-      (struct pdf_obj *)pdf_create_name(pdf, "XObject"));
-  dictionary = pdf_prepend_dictionary(pdf, dictionary, "Subtype",
-      (struct pdf_obj *)pdf_create_name(pdf, "Image"));
-  dictionary = pdf_prepend_dictionary(pdf, dictionary, "Width",
-      (struct pdf_obj *)pdf_create_integer(pdf, info->width));
-  dictionary = pdf_prepend_dictionary(pdf, dictionary, "Height",
-      (struct pdf_obj *)pdf_create_integer(pdf, info->height));
-  dictionary = pdf_prepend_dictionary(pdf, dictionary, "ColorSpace",
-      (struct pdf_obj *)pdf_create_name(pdf, color_space));
-  dictionary = pdf_prepend_dictionary(pdf, dictionary, "BitsPerComponent",
-      (struct pdf_obj *)pdf_create_integer(pdf, 8));
-  ref = pdf_allocate_indirect_obj(pdf);
-  pdf_define_stream(pdf, ref, dictionary, filters, length, bytes);
-  return ref;
+  memcpy(bytes, entry->bytes, length);
+  tw_pop_trap(&trap);
+  pthread_mutex_unlock(&cache->mutex);
+  return define_jpeg(pdf, info, length, bytes);
 }
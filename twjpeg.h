@@ -5,6 +5,7 @@
 
 /*
  * The following must be included before this file:
+#include <pthread.h>
 #include "twpdf.h"
  */
 
@@ -13,5 +14,32 @@ struct pdf_jpeg_info {
   unsigned char components;
 };
 
+/*
+ * Keeps loaded JPEG files so long running processes only read and parse each
+ * image once. Entries are checked against the file's status on every use.
+ */
+struct pdf_jpeg_cache_entry {
+  struct pdf_jpeg_cache_entry *next;
+  char *fname;
+  long dev, ino, size, mtime;
+  struct pdf_jpeg_info info;
+  long length;
+  char *bytes;
+};
+
+struct pdf_jpeg_cache {
+  pthread_mutex_t mutex;
+  int entry_count;
+  struct pdf_jpeg_cache_entry *entries;
+};
+
+void pdf_jpeg_read_info(const char *fname, struct pdf_jpeg_info *info);
 struct pdf_obj_indirect *pdf_jpeg_define(struct pdf *pdf, const char *fname,
     struct pdf_jpeg_info *info);
+
+void pdf_jpeg_cache_init(struct pdf_jpeg_cache *cache);
+void pdf_jpeg_cache_free(struct pdf_jpeg_cache *cache);
+void pdf_jpeg_cache_read_info(struct pdf_jpeg_cache *cache, const char *fname,
+    struct pdf_jpeg_info *info);
+struct pdf_obj_indirect *pdf_jpeg_cache_define(struct pdf_jpeg_cache *cache,
+    struct pdf *pdf, const char *fname, struct pdf_jpeg_info *info);
@@ -4,54 +4,150 @@
  */
 
 #include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "utils.h"
 #include "twpdf.h"
 #include "twpages.h"
 
+static struct pdf_obj_dictionary *update_pages_parent(struct pdf *pdf,
+    struct pdf_obj_array *pages_array, int page_count);
+
+static const struct pdf_template_piece page_pieces[] = {
+  PDF_PIECE("<< /Contents "),
+  PDF_PIECE("\n/Parent "),
+  PDF_PIECE("\n/Type /Page\n>>"),
+};
+static const enum pdf_hole_type page_holes[] = {
+  PDF_HOLE_REFERENCE, PDF_HOLE_REFERENCE,
+};
+static const char *const page_keys[] = { "Contents", "Parent" };
+static const struct pdf_template page_template = {
+  2, page_pieces, page_holes, page_keys,
+  PDF_KIND_PAGE,
+};
+
+/* A page that doesn't inherit its resources or media box. */
+static const struct pdf_template_piece own_page_pieces[] = {
+  PDF_PIECE("<< /MediaBox [0\n0\n595\n842]\n/Resources "),
+  PDF_PIECE("\n/Contents "),
+  PDF_PIECE("\n/Parent "),
+  PDF_PIECE("\n/Type /Page\n>>"),
+};
+static const enum pdf_hole_type own_page_holes[] = {
+  PDF_HOLE_REFERENCE, PDF_HOLE_REFERENCE, PDF_HOLE_REFERENCE,
+};
+static const char *const own_page_keys[] = { "Resources", "Contents", "Parent" };
+static const struct pdf_template own_page_template = {
+  3, own_page_pieces, own_page_holes, own_page_keys,
+  PDF_KIND_PAGE,
+};
+
+/*
+ * The base file's page tree root with the new pages added to the end of its
+ * kids. Its other entries are kept as they were.
+ */
+static struct pdf_obj_dictionary *
+update_pages_parent(struct pdf *pdf, struct pdf_obj_array *pages_array,
+    int page_count)
+{
+  struct pdf_obj_dictionary *entry, *pages_parent;
+  struct pdf_obj_array *kids, *kid;
+  struct pdf_obj **values;
+  int kid_count;
+  kids = NULL;
+  pages_parent = pdf_create_dictionary(pdf);
+  for (entry = pdf->base->pages; entry->key; entry = entry->tail) {
+    if (!strcmp(entry->key->string, "Kids"))
+      kids = (struct pdf_obj_array *)entry->value;
+    else if (!strcmp(entry->key->string, "Count"))
+      page_count += ((struct pdf_obj_integer *)entry->value)->value;
+    else
+      pages_parent = pdf_prepend_dictionary(pdf, pages_parent,
+          entry->key->string, entry->value);
+  }
+  /* Arrays can only be prepended to, so walk the old kids backwards. */
+  kid_count = 0;
+  for (kid = kids; kid->value; kid = kid->tail)
+    kid_count++;
+  values = xmalloc(kid_count * sizeof(struct pdf_obj *));
+  kid_count = 0;
+  for (kid = kids; kid->value; kid = kid->tail)
+    values[kid_count++] = kid->value;
+  while (kid_count--)
+    pages_array = pdf_prepend_array(pdf, pages_array, values[kid_count]);
+  free(values);
+  pages_parent = pdf_prepend_dictionary(pdf, pages_parent, "Kids",
+      (struct pdf_obj *)pages_array);
+  pages_parent = pdf_prepend_dictionary(pdf, pages_parent, "Count",
+      (struct pdf_obj *)pdf_create_integer(pdf, page_count));
+  return pages_parent;
+}
+
 void 
 pdf_pages_init(struct pdf *pdf, struct pdf_pages *pages)
 {
   pages->page_allocated = 64;
   pages->page_count = 0;
-  pages->page_objs = xmalloc(pages->page_allocated * sizeof(void *));
-  pages->pages_parent_ref = pdf_allocate_indirect_obj(pdf);
+  pages->contents = xmalloc(pages->page_allocated * sizeof(void *));
+  if (pdf->base)
+    pages->pages_parent_ref = pdf_create_reference(pdf,
+        pdf->base->pages_obj_num);
+  else
+    pages->pages_parent_ref = pdf_allocate_indirect_obj(pdf);
 }
 
 void 
 pdf_pages_free(struct pdf_pages *pages)
 {
-  free(pages->page_objs);
+  free(pages->contents);
 }
 
 void 
 pdf_pages_add_page(struct pdf *pdf, struct pdf_pages *pages,
     struct pdf_obj_indirect *content)
 {
-  struct pdf_obj_dictionary *page;
-  page = pdf_create_dictionary(pdf);
-  page = pdf_prepend_dictionary(pdf, page, "Type",
-      (struct pdf_obj *)pdf_create_name(pdf, "Page"));
-  page = pdf_prepend_dictionary(pdf, page, "Parent",
-      (struct pdf_obj *)pages->pages_parent_ref);
-  page = pdf_prepend_dictionary(pdf, page, "Contents",
-      (struct pdf_obj *)content);
   if (pages->page_count == pages->page_allocated) {
     pages->page_allocated += 64;
-    pages->page_objs = xrealloc(pages->page_objs, pages->page_allocated * sizeof(void *));
+    pages->contents = xrealloc(pages->contents, pages->page_allocated * sizeof(void *));
   }
-  pages->page_objs[pages->page_count++] = (struct pdf_obj *)page;
+  pages->contents[pages->page_count++] = content;
+}
+
+/*
+ * At most how many bytes pdf_pages_define_catalogue writes for a pdf that is
+ * neither linearized nor an update, with resources resources_length bytes
+ * long and no object number longer than digits. Each page adds its page
+ * object and a kid in the page tree, and an object number comes with
+ * "n 0 obj\n" and "\nendobj\n", or " 0 R" for a reference. The keys of the
+ * page tree root and the catalogue take under 256 bytes.
+ */
+long
+pdf_pages_bound(const struct pdf_pages *pages, long resources_length,
+    int digits)
+{
+  long wrap, page, kid;
+  int i;
+  wrap = digits + 15;
+  page = wrap + 2 * (digits + 4);
+  for (i = 0; i <= page_template.hole_count; i++)
+    page += page_template.pieces[i].length;
+  kid = digits + 5;
+  return pages->page_count * (page + kid) + 2 * (wrap + digits + 4)
+    + resources_length + 256;
 }
 
 void
 pdf_pages_define_catalogue(struct pdf *pdf, struct pdf_obj_indirect *ref,
     struct pdf_pages *pages, struct pdf_obj *resources)
 {
-  int i;
-  struct pdf_obj_indirect *page_ref;
+  int i, values[3];
+  struct pdf_obj_indirect *page_ref, *resources_ref;
   struct pdf_obj_array *pages_array, *media_box;
   struct pdf_obj_dictionary *pages_parent, *catalogue;
+  struct pdf_obj_template *page;
 
   media_box = pdf_create_array(pdf);
   media_box = pdf_prepend_array(pdf, media_box,
@@ -63,13 +159,43 @@ pdf_pages_define_catalogue(struct pdf *pdf, struct pdf_obj_indirect *ref,
   media_box = pdf_prepend_array(pdf, media_box,
       (struct pdf_obj *)pdf_create_integer(pdf, 0));
 
+  /*
+   * Linearized files should not rely on inherited page attributes, so each
+   * page refers to the resources itself. Pages appended to a base file can't
+   * share the resources its pages inherit either.
+   */
+  resources_ref = NULL;
+  if (pdf->linearize || pdf->base) {
+    resources_ref = pdf_allocate_indirect_obj(pdf);
+    pdf_define_obj(pdf, resources_ref, resources, 0);
+  }
+
+  /* Every page has the same shape, so they are written from a template. */
   pages_array = pdf_create_array(pdf);
   for (i = pages->page_count - 1; i >= 0; i--) {
+    if (resources_ref) {
+      values[0] = resources_ref->obj_num;
+      values[1] = pages->contents[i]->obj_num;
+      values[2] = pages->pages_parent_ref->obj_num;
+      page = pdf_create_template(pdf, &own_page_template, values);
+    } else {
+      values[0] = pages->contents[i]->obj_num;
+      values[1] = pages->pages_parent_ref->obj_num;
+      page = pdf_create_template(pdf, &page_template, values);
+    }
     page_ref = pdf_allocate_indirect_obj(pdf);
-    pdf_define_obj(pdf, page_ref, pages->page_objs[i], 0);
+    pdf_define_obj(pdf, page_ref, (struct pdf_obj *)page, 0);
     pages_array = pdf_prepend_array(pdf, pages_array, (struct pdf_obj *)page_ref);
   }
 
+  /* An update leaves the catalogue as it is, with the same /Pages. */
+  if (pdf->base) {
+    pages_parent = update_pages_parent(pdf, pages_array, pages->page_count);
+    pdf_define_obj(pdf, pages->pages_parent_ref,
+        (struct pdf_obj *)pages_parent, 0);
+    return;
+  }
+
   pages_parent = pdf_create_dictionary(pdf);
   pages_parent = pdf_prepend_dictionary(pdf, pages_parent, "Type",
       (struct pdf_obj *)pdf_create_name(pdf, "Pages"));
@@ -77,10 +203,12 @@ pdf_pages_define_catalogue(struct pdf *pdf, struct pdf_obj_indirect *ref,
       (struct pdf_obj *)pages_array);
   pages_parent = pdf_prepend_dictionary(pdf, pages_parent, "Count",
       (struct pdf_obj *)pdf_create_integer(pdf, pages->page_count));
-  pages_parent = pdf_prepend_dictionary(pdf, pages_parent, "Resources",
-      resources);
-  pages_parent = pdf_prepend_dictionary(pdf, pages_parent, "MediaBox",
-      (struct pdf_obj *)media_box);
+  if (resources_ref == NULL) {
+    pages_parent = pdf_prepend_dictionary(pdf, pages_parent, "Resources",
+        resources);
+    pages_parent = pdf_prepend_dictionary(pdf, pages_parent, "MediaBox",
+        (struct pdf_obj *)media_box);
+  }
 
   catalogue = pdf_create_dictionary(pdf);
   catalogue = pdf_prepend_dictionary(pdf, catalogue, "Type",
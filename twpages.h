@@ -10,7 +10,7 @@
 
 struct pdf_pages {
   int page_allocated, page_count;
-  struct pdf_obj **page_objs;
+  struct pdf_obj_indirect **contents;
   struct pdf_obj_indirect *pages_parent_ref;
 };
 
@@ -21,3 +21,5 @@ void pdf_pages_add_page(struct pdf *pdf, struct pdf_pages *pages,
     struct pdf_obj_indirect *content);
 void pdf_pages_define_catalogue(struct pdf *pdf, struct pdf_obj_indirect *ref,
     struct pdf_pages *pages, struct pdf_obj *resources);
+long pdf_pages_bound(const struct pdf_pages *pages, long resources_length,
+    int digits);
@@ -3,14 +3,23 @@
  * See LICENSE for license details.
  */
 
+#include <setjmp.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "twpdf.h"
 #include "utils.h"
+#include "typewriter.h"
+#include "twerror.h"
 
 static void * allocate_obj(struct pdf *pdf, size_t size);
 static void free_obj(struct pdf_obj *obj);
+static void forget_obj(struct pdf *pdf, struct pdf_obj *obj);
+static void release_obj(struct pdf *pdf, struct pdf_obj *obj);
+static struct pdf_obj_stream *allocate_stream(struct pdf *pdf,
+    struct pdf_obj *dictionary, long size, char *bytes);
+static void spill_stream(struct pdf *pdf, struct pdf_obj_stream *stream);
 
 static void *
 allocate_obj(struct pdf *pdf, size_t size)
@@ -35,9 +44,92 @@ free_obj(struct pdf_obj *obj)
   free(obj);
 }
 
+/* Free one object before the rest of the pdf. */
+static void
+forget_obj(struct pdf *pdf, struct pdf_obj *obj)
+{
+  int i;
+  /* It was almost always allocated just before. */
+  for (i = pdf->obj_count - 1; pdf->objs[i] != obj; i--)
+    ;
+  pdf->objs[i] = pdf->objs[--pdf->obj_count];
+  free_obj(obj);
+}
+
+/*
+ * Free an object once it has been written, if nothing else can refer to it.
+ * Streams are always indirect and a template belongs to one object, but
+ * dictionaries and arrays can share their tails, so they are kept.
+ */
+static void
+release_obj(struct pdf *pdf, struct pdf_obj *obj)
+{
+  struct pdf_obj_stream *stream;
+  switch (obj->type) {
+  case PDF_OBJ_STREAM:
+    stream = (struct pdf_obj_stream *)obj;
+    if (stream->bytes)
+      pdf->stream_memory -= stream->size;
+    release_obj(pdf, stream->dictionary);
+    forget_obj(pdf, obj);
+    break;
+  case PDF_OBJ_TEMPLATE:
+    forget_obj(pdf, obj);
+    break;
+  default:
+    break;
+  }
+}
+
+static struct pdf_obj_stream *
+allocate_stream(struct pdf *pdf, struct pdf_obj *dictionary, long size,
+    char *bytes)
+{
+  struct pdf_obj_stream *stream;
+  stream = allocate_obj(pdf, sizeof(struct pdf_obj_stream));
+  stream->type = PDF_OBJ_STREAM;
+  stream->size = size;
+  stream->ascii85 = pdf->ascii85;
+  stream->bytes = bytes;
+  stream->spill = NULL;
+  stream->dictionary = dictionary;
+  pdf->stream_memory += size;
+  if (pdf->memory_budget && pdf->stream_memory > pdf->memory_budget)
+    spill_stream(pdf, stream);
+  return stream;
+}
+
+/*
+ * Move a finished stream's bytes to the end of the spill file, an unlinked
+ * temporary file shared by the whole pdf.
+ */
+static void
+spill_stream(struct pdf *pdf, struct pdf_obj_stream *stream)
+{
+  if (pdf->spill == NULL && (pdf->spill = tmpfile()) == NULL)
+    tw_fail(TW_ERR_IO, "twpdf: Failed to create spill file.");
+  fseek(pdf->spill, 0, SEEK_END);
+  stream->spill_offset = ftell(pdf->spill);
+  if (fwrite(stream->bytes, 1, stream->size, pdf->spill)
+      != (size_t)stream->size)
+    tw_fail(TW_ERR_IO, "twpdf: Error writing spill file.");
+  free(stream->bytes);
+  stream->bytes = NULL;
+  stream->spill = pdf->spill;
+  pdf->stream_memory -= stream->size;
+}
+
 void
 pdf_init_empty(struct pdf *pdf)
 {
+  pdf->linearize = 0;
+  pdf->ascii85 = 0;
+  pdf->base = NULL;
+  pdf->memory_budget = 0;
+  pdf->stream_memory = 0;
+  pdf->spill = NULL;
+  pdf->output = NULL;
+  pdf->stats = NULL;
   pdf->next_obj_num = 1;
   pdf->defs = NULL;
   pdf->root = NULL;
@@ -61,6 +153,8 @@ pdf_free(struct pdf *pdf)
   for (i = 0; i < pdf->obj_count; i++)
     free_obj(pdf->objs[i]);
   free(pdf->objs);
+  if (pdf->spill)
+    fclose(pdf->spill);
 }
 
 struct pdf_obj_boolean *
@@ -84,12 +178,13 @@ pdf_create_integer(struct pdf *pdf, int value)
 }
 
 struct pdf_obj_string *
-pdf_create_string(struct pdf *pdf, const char *string)
+pdf_create_string(struct pdf *pdf, const char *string, long length)
 {
   struct pdf_obj_string *obj;
   obj = allocate_obj(pdf, sizeof(struct pdf_obj_string));
   obj->type = PDF_OBJ_STRING;
   obj->string = string;
+  obj->length = length;
   return obj;
 }
 
@@ -103,6 +198,17 @@ pdf_create_name(struct pdf *pdf, const char *name)
   return obj;
 }
 
+/* Like pdf_create_name, but the string is copied into the object. */
+struct pdf_obj_name *
+pdf_create_name_copy(struct pdf *pdf, const char *name)
+{
+  struct pdf_obj_name *obj;
+  obj = allocate_obj(pdf, sizeof(struct pdf_obj_name) + strlen(name) + 1);
+  obj->type = PDF_OBJ_NAME;
+  obj->string = strcpy((char *)(obj + 1), name);
+  return obj;
+}
+
 struct pdf_obj_array *
 pdf_create_array(struct pdf *pdf)
 {
@@ -136,6 +242,30 @@ pdf_allocate_indirect_obj(struct pdf *pdf)
   return obj;
 }
 
+/* Refer to an object numbered elsewhere, such as in a base file. */
+struct pdf_obj_indirect *
+pdf_create_reference(struct pdf *pdf, int obj_num)
+{
+  struct pdf_obj_indirect *obj;
+  obj = allocate_obj(pdf, sizeof(struct pdf_obj_indirect));
+  obj->type = PDF_OBJ_INDIRECT;
+  obj->obj_num = obj_num;
+  return obj;
+}
+
+struct pdf_obj_template *
+pdf_create_template(struct pdf *pdf, const struct pdf_template *tmpl,
+    const int *values)
+{
+  struct pdf_obj_template *obj;
+  obj = allocate_obj(pdf, sizeof(struct pdf_obj_template)
+      + tmpl->hole_count * sizeof(int));
+  obj->type = PDF_OBJ_TEMPLATE;
+  obj->tmpl = tmpl;
+  memcpy(obj->values, values, tmpl->hole_count * sizeof(int));
+  return obj;
+}
+
 struct pdf_obj_array *
 pdf_prepend_array(struct pdf *pdf, struct pdf_obj_array *array,
     struct pdf_obj *obj)
@@ -166,37 +296,80 @@ pdf_define_obj(struct pdf *pdf, struct pdf_obj_indirect *ref,
     struct pdf_obj *obj, int is_root)
 {
   struct pdf_indirect_obj_def *def;
+  /* The root is written last, by pdf_output_end. */
+  if (pdf->output && !is_root) {
+    pdf_output_obj(pdf->output, pdf, ref->obj_num, obj);
+    release_obj(pdf, obj);
+    return;
+  }
   def = xmalloc(sizeof(struct pdf_indirect_obj_def));
   def->obj_num = ref->obj_num;
   def->obj = obj;
   def->next = pdf->defs;
   pdf->defs = def;
   if (is_root && pdf->root) {
-    fprintf(stderr, "twpdf: pdf cant have two root objects.\n");
-    exit(1);
+    tw_fail(TW_ERR_INVALID, "twpdf: pdf cant have two root objects.");
   } else if (is_root) {
     pdf->root = def;
   }
 }
 
-void
-pdf_define_stream(struct pdf *pdf, struct pdf_obj_indirect *ref,
-    struct pdf_obj_dictionary *dictionary, struct pdf_obj_array *filters,
-    long size, char *bytes)
+struct pdf_obj_stream *
+pdf_create_stream(struct pdf *pdf, struct pdf_obj_dictionary *dictionary,
+    struct pdf_obj_array *filters, long size, char *bytes)
 {
-  struct pdf_obj_stream *stream;
-  stream = allocate_obj(pdf, sizeof(struct pdf_obj_stream));
-  stream->type = PDF_OBJ_STREAM;
-  stream->size = size;
-  stream->bytes = bytes;
-  filters = pdf_prepend_array(pdf, filters,
-      (struct pdf_obj *)pdf_create_name(pdf, "ASCIIHexDecode"));
+  filters = pdf_prepend_array(pdf, filters, (struct pdf_obj *)pdf_create_name(
+        pdf, pdf->ascii85 ? "ASCII85Decode" : "ASCIIHexDecode"));
   dictionary = pdf_prepend_dictionary(pdf, dictionary, "Filter",
       (struct pdf_obj *)filters);
   dictionary = pdf_prepend_dictionary(pdf, dictionary, "Length",
-      (struct pdf_obj *)pdf_create_integer(pdf, size * 2));
+      (struct pdf_obj *)pdf_create_integer(pdf,
+        pdf_encoded_length(pdf->ascii85, size)));
   dictionary = pdf_prepend_dictionary(pdf, dictionary, "Length1",
       (struct pdf_obj *)pdf_create_integer(pdf, size));
-  stream->dictionary = dictionary;
-  pdf_define_obj(pdf, ref, (struct pdf_obj *)stream, 0);
+  return allocate_stream(pdf, (struct pdf_obj *)dictionary, size, bytes);
+}
+
+void
+pdf_define_stream(struct pdf *pdf, struct pdf_obj_indirect *ref,
+    struct pdf_obj_dictionary *dictionary, struct pdf_obj_array *filters,
+    long size, char *bytes)
+{
+  pdf_define_obj(pdf, ref, (struct pdf_obj *)pdf_create_stream(pdf,
+        dictionary, filters, size, bytes), 0);
+}
+
+/*
+ * Define a stream whose dictionary, including its /Length1, /Length and
+ * /Filter for the pdf's encoding, comes from a template.
+ */
+void
+pdf_define_template_stream(struct pdf *pdf, struct pdf_obj_indirect *ref,
+    struct pdf_obj_template *dictionary, long size, char *bytes)
+{
+  pdf_define_obj(pdf, ref, (struct pdf_obj *)allocate_stream(pdf,
+        (struct pdf_obj *)dictionary, size, bytes), 0);
+}
+
+/*
+ * The length of size bytes once encoded. ASCII85 takes 5 characters for each
+ * group of 4 bytes, n + 1 for a last group of n, then "~>". Groups of zeros
+ * aren't shortened to 'z', so the length is known before encoding.
+ */
+long
+pdf_encoded_length(int ascii85, long size)
+{
+  if (!ascii85)
+    return size * 2;
+  return size / 4 * 5 + (size % 4 ? size % 4 + 1 : 0) + 2;
+}
+
+/* Read back length bytes of a spilled stream, starting offset bytes in. */
+void
+pdf_read_spilled(const struct pdf_obj_stream *stream, long offset,
+    char *bytes, long length)
+{
+  if (fseek(stream->spill, stream->spill_offset + offset, SEEK_SET)
+      || fread(bytes, 1, length, stream->spill) != (size_t)length)
+    tw_fail(TW_ERR_IO, "twpdf: Error reading spill file.");
 }
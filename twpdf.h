@@ -3,6 +3,11 @@
  * See LICENSE for license details.
  */
 
+/*
+ * The following must be included before this file:
+#include <stdio.h>
+ */
+
 enum pdf_obj_type {
   PDF_OBJ_BOOLEAN         = 0,
   PDF_OBJ_INTEGER         = 1,
@@ -13,6 +18,7 @@ enum pdf_obj_type {
   PDF_OBJ_STREAM          = 6,
   PDF_OBJ_NULL            = 7,
   PDF_OBJ_INDIRECT        = 8,
+  PDF_OBJ_TEMPLATE        = 9,
 };
 
 struct pdf_obj {
@@ -33,6 +39,7 @@ struct pdf_obj_integer {
 struct pdf_obj_string {
   enum pdf_obj_type type;
   const char *string;
+  long length;
 };
 
 struct pdf_obj_name {
@@ -56,8 +63,12 @@ struct pdf_obj_dictionary {
 struct pdf_obj_stream {
   enum pdf_obj_type type;
   long size;
-  char *bytes;
-  struct pdf_obj_dictionary *dictionary;
+  int ascii85;          /* Encoded with ASCII85 rather than ASCIIHex. */
+  char *bytes;          /* NULL once spilled. */
+  FILE *spill;
+  long spill_offset;
+  /* A dictionary, or a template of one. */
+  struct pdf_obj *dictionary;
 };
 
 struct pdf_obj_indirect {
@@ -65,14 +76,84 @@ struct pdf_obj_indirect {
   int obj_num;
 };
 
+enum pdf_hole_type {
+  PDF_HOLE_INTEGER,
+  PDF_HOLE_REFERENCE,
+};
+
+/* What an object is for, as counted by struct pdf_stats. */
+enum pdf_kind {
+  PDF_KIND_OTHER,       /* Resources, fonts and the rest. */
+  PDF_KIND_CONTENT,     /* Page content streams. */
+  PDF_KIND_IMAGE,       /* Image XObjects. */
+  PDF_KIND_FORM,        /* Form XObjects of repeated lines. */
+  PDF_KIND_PAGE,        /* Page dictionaries. */
+  PDF_KIND_PAGE_TREE,   /* The page tree root and the catalogue. */
+  PDF_KIND_XREF,        /* Cross-reference tables, trailers and hints. */
+  PDF_KIND_COUNT,
+};
+
+struct pdf_template_piece {
+  const char *bytes;
+  int length;
+};
+
+#define PDF_PIECE(s) { s, sizeof(s) - 1 }
+
+/*
+ * The serialized form of objects that always have the same shape, such as
+ * page dictionaries. An object made from a template only holds the values
+ * for its holes, and is written by copying the pieces around them.
+ */
+struct pdf_template {
+  int hole_count;
+  const struct pdf_template_piece *pieces;  /* One more than the holes. */
+  const enum pdf_hole_type *holes;
+  const char *const *keys;                  /* Dictionary key of each hole. */
+  enum pdf_kind kind;
+};
+
+struct pdf_obj_template {
+  enum pdf_obj_type type;
+  const struct pdf_template *tmpl;
+  int values[];                             /* Object number for references. */
+};
+
 struct pdf_indirect_obj_def {
   int obj_num;
   struct pdf_obj *obj;
   struct pdf_indirect_obj_def *next;
 };
 
+/*
+ * An existing file that new objects are appended to as an incremental
+ * update, see twread.c.
+ */
+struct pdf_base {
+  long length;          /* Size of the existing file. */
+  long xref_offset;     /* Offset of its last cross-reference section. */
+  int size;             /* /Size from its trailer. */
+  int root_obj_num, pages_obj_num;
+  struct pdf_obj_dictionary *pages;
+  /* Names read from the file, which the pdf objects point into. */
+  int name_allocated, name_count;
+  char **names;
+};
+
 /* Stored in abstract format, only converted to pdf before writing to disk. */
 struct pdf {
+  /* Write options, set by the user before building. */
+  int linearize;
+  int ascii85;
+  struct pdf_base *base;
+  /* Stream bytes past this many go to a temporary file, 0 for no limit. */
+  long memory_budget;
+  long stream_memory;
+  FILE *spill;
+  /* Objects are written as they are defined, see pdf_output_immediate. */
+  struct pdf_output *output;
+  /* Counted as they are written when set. */
+  struct pdf_stats *stats;
   int next_obj_num;
   struct pdf_indirect_obj_def *defs;
   struct pdf_indirect_obj_def *root;
@@ -86,11 +167,15 @@ void pdf_free(struct pdf *pdf);
 
 struct pdf_obj_boolean         *pdf_create_boolean(struct pdf *pdf, int value);
 struct pdf_obj_integer         *pdf_create_integer(struct pdf *pdf, int value);
-struct pdf_obj_string          *pdf_create_string(struct pdf *pdf, const char *string);
+struct pdf_obj_string          *pdf_create_string(struct pdf *pdf, const char *string, long length);
 struct pdf_obj_name            *pdf_create_name(struct pdf *pdf, const char *name);
+struct pdf_obj_name            *pdf_create_name_copy(struct pdf *pdf, const char *name);
 struct pdf_obj_array           *pdf_create_array(struct pdf *pdf);
 struct pdf_obj_dictionary      *pdf_create_dictionary(struct pdf *pdf);
 struct pdf_obj_indirect        *pdf_allocate_indirect_obj(struct pdf *pdf);
+struct pdf_obj_indirect        *pdf_create_reference(struct pdf *pdf, int obj_num);
+struct pdf_obj_template        *pdf_create_template(struct pdf *pdf,
+    const struct pdf_template *tmpl, const int *values);
 
 struct pdf_obj_array *pdf_prepend_array(struct pdf *pdf,
     struct pdf_obj_array *array, struct pdf_obj *obj);
@@ -100,9 +185,106 @@ struct pdf_obj_dictionary *pdf_prepend_dictionary(struct pdf *pdf,
 
 void pdf_define_obj(struct pdf *pdf, struct pdf_obj_indirect *ref,
     struct pdf_obj *obj, int is_root);
+struct pdf_obj_stream *pdf_create_stream(struct pdf *pdf,
+    struct pdf_obj_dictionary *dictionary, struct pdf_obj_array *filters,
+    long size, char *bytes);
 void pdf_define_stream(struct pdf *pdf, struct pdf_obj_indirect *ref,
     struct pdf_obj_dictionary *dictionary, struct pdf_obj_array *filters,
     long size, char *bytes);
+void pdf_define_template_stream(struct pdf *pdf, struct pdf_obj_indirect *ref,
+    struct pdf_obj_template *dictionary, long size, char *bytes);
+long pdf_encoded_length(int ascii85, long size);
+void pdf_read_spilled(const struct pdf_obj_stream *stream, long offset,
+    char *bytes, long length);
+
+/*
+ * A pdf written out while it is still being built, see pdf_output_flush.
+ */
+struct pdf_output {
+  FILE *file;
+  long offset;
+  long *obj_offsets;
+  int obj_allocated;
+  struct pdf_indirect_obj_def *flushed;
+  /* While staging, file is in memory and target the real one. */
+  FILE *target;
+  char *staged;
+  size_t staged_length;
+  long stage_offset;
+};
+
+/*
+ * Where a pdf goes other than a named file. Every kind of sink is opened as
+ * a stdio stream, so pdf_write_file and pdf_output take it like any file.
+ */
+struct pdf_sink {
+  FILE *file;
+  char *bytes;          /* Memory sinks, once closed. */
+  size_t length;
+  int (*write)(void *arg, const char *bytes, long length);
+  void *arg;
+  int fd;
+  int failed;           /* Once set, nothing more is passed on. */
+};
+
+/* A content stream or image counted by struct pdf_stats. */
+struct pdf_stats_obj {
+  int obj_num;          /* As written. */
+  int order;            /* As defined. */
+  long bytes;
+  int page;
+  int width, height;    /* Images only. */
+};
+
+/*
+ * What a written pdf is made of, by kind of object. Objects are counted from
+ * "n 0 obj" to "endobj", and streams also by their bytes before and after
+ * encoding.
+ */
+struct pdf_stats {
+  long file_bytes;
+  int counts[PDF_KIND_COUNT];
+  long bytes[PDF_KIND_COUNT];
+  long stream_bytes[PDF_KIND_COUNT];
+  long encoded_bytes[PDF_KIND_COUNT];
+  int ascii85;
+  struct pdf_stats_obj *contents, *images;
+  int content_count, content_allocated;
+  int image_count, image_allocated;
+};
+
+/* twread.c */
+void pdf_read_base(struct pdf *pdf, struct pdf_base *base, const char *fname);
+void pdf_free_base(struct pdf_base *base);
 
 /* twwrite.c */
 void pdf_write(struct pdf *pdf, const char *fname);
+void pdf_write_file(struct pdf *pdf, FILE *file);
+void pdf_output_begin(struct pdf_output *out, FILE *file);
+void pdf_output_flush(struct pdf_output *out, struct pdf *pdf);
+void pdf_output_immediate(struct pdf_output *out, struct pdf *pdf);
+void pdf_output_obj(struct pdf_output *out, struct pdf *pdf, int obj_num,
+    const struct pdf_obj *obj);
+void pdf_output_end(struct pdf_output *out, struct pdf *pdf);
+void pdf_output_stage(struct pdf_output *out);
+void pdf_output_commit(struct pdf_output *out);
+void pdf_output_discard(struct pdf_output *out, struct pdf *pdf, int obj_num);
+long pdf_obj_length(const struct pdf_obj *obj);
+long pdf_xref_bound(int obj_count);
+
+/* twsink.c */
+void pdf_sink_memory(struct pdf_sink *sink);
+void pdf_sink_fd(struct pdf_sink *sink, int fd);
+void pdf_sink_callback(struct pdf_sink *sink,
+    int (*write)(void *arg, const char *bytes, long length), void *arg);
+void pdf_sink_close(struct pdf_sink *sink);
+void pdf_write_sink(struct pdf *pdf, struct pdf_sink *sink);
+
+/* twstats.c */
+void pdf_stats_init(struct pdf_stats *stats);
+void pdf_stats_free(struct pdf_stats *stats);
+void pdf_stats_count_obj(struct pdf *pdf, int obj_num, int written_num,
+    const struct pdf_obj *obj, long length);
+void pdf_stats_count(struct pdf *pdf, enum pdf_kind kind, long length);
+void pdf_stats_write_file(struct pdf_stats *stats, FILE *file);
+void pdf_stats_write(struct pdf_stats *stats, const char *fname);
@@ -0,0 +1,438 @@
+/*
+ * Copyright (C) 2023 Christopher Lang
+ * See LICENSE for license details.
+ */
+
+/*
+ * Read back enough of an existing pdf to append pages to it as an
+ * incremental update: the chain of cross-reference sections and trailers,
+ * the catalogue and the root of the page tree. The page tree root is parsed
+ * into pdf objects so that it can be written again with more kids.
+ *
+ * Only the plain syntax that twpdf writes itself is understood. Files using
+ * cross-reference streams, or strings, real numbers or nulls in these
+ * objects, are rejected.
+ */
+
+#include <ctype.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "typewriter.h"
+#include "twerror.h"
+#include "twpdf.h"
+
+#define TAIL_SIZE 1024
+#define MAX_XREF_SECTIONS 65536
+#define MAX_TOKEN 128
+
+struct reader {
+  FILE *file;
+  const char *fname;
+  struct pdf *pdf;
+  struct pdf_base *base;
+  /* Offset of each object, 0 if not seen yet and -1 if free. */
+  int offset_allocated;
+  long *offsets;
+};
+
+static void fail(struct reader *r, const char *what)
+  __attribute__((noreturn));
+static int is_delimiter(int c);
+static int skip_space(struct reader *r);
+static void read_token(struct reader *r, int c, char *token);
+static long read_long(struct reader *r, int c);
+static void expect_keyword(struct reader *r, int c, const char *keyword);
+static const char *read_name(struct reader *r);
+static struct pdf_obj *read_number(struct reader *r, int c);
+static struct pdf_obj *read_array(struct reader *r);
+static struct pdf_obj *read_dictionary(struct reader *r);
+static struct pdf_obj *read_obj(struct reader *r, int c);
+static const struct pdf_obj *dict_get(const struct pdf_obj_dictionary *dict,
+    const char *key);
+static void set_offset(struct reader *r, long obj_num, long offset);
+static struct pdf_obj_dictionary *read_xref_section(struct reader *r,
+    long offset);
+static long read_startxref(struct reader *r);
+static struct pdf_obj_dictionary *read_indirect_dictionary(struct reader *r,
+    int obj_num);
+
+static void
+fail(struct reader *r, const char *what)
+{
+  tw_fail(TW_ERR_PDF, "twpdf: %s in %s.", what, r->fname);
+}
+
+static int
+is_delimiter(int c)
+{
+  /* Includes '\0', which strchr finds as the terminator. */
+  return c == EOF || strchr(" \t\n\f\r()<>[]{}/%", c);
+}
+
+/* Returns the first character after any whitespace and comments. */
+static int
+skip_space(struct reader *r)
+{
+  int c;
+  for (;;) {
+    c = getc(r->file);
+    if (c == '%')
+      while (c != '\n' && c != '\r' && c != EOF)
+        c = getc(r->file);
+    else if (c == EOF || !strchr(" \t\n\f\r", c))
+      return c;
+  }
+}
+
+/* Reads the regular characters starting at c. */
+static void
+read_token(struct reader *r, int c, char *token)
+{
+  int length;
+  length = 0;
+  while (!is_delimiter(c)) {
+    if (length == MAX_TOKEN - 1)
+      fail(r, "Token too long");
+    token[length++] = c;
+    c = getc(r->file);
+  }
+  token[length] = '\0';
+  if (c != EOF)
+    ungetc(c, r->file);
+}
+
+static long
+read_long(struct reader *r, int c)
+{
+  char token[MAX_TOKEN], *end;
+  long value;
+  read_token(r, c, token);
+  value = strtol(token, &end, 10);
+  if (end == token || *end)
+    fail(r, "Expected an integer");
+  return value;
+}
+
+static void
+expect_keyword(struct reader *r, int c, const char *keyword)
+{
+  char token[MAX_TOKEN];
+  read_token(r, c, token);
+  if (strcmp(token, keyword))
+    tw_fail(TW_ERR_PDF, "twpdf: Expected %s in %s.", keyword, r->fname);
+}
+
+/* Reads the name after its '/', decoding #xx escapes. */
+static const char *
+read_name(struct reader *r)
+{
+  struct pdf_base *base;
+  char token[MAX_TOKEN], *name;
+  int i, j;
+  unsigned int hex;
+  base = r->base;
+  read_token(r, getc(r->file), token);
+  name = xmalloc(strlen(token) + 1);
+  for (i = j = 0; token[i]; i++, j++) {
+    if (token[i] == '#' && isxdigit((unsigned char)token[i + 1])
+        && isxdigit((unsigned char)token[i + 2])) {
+      sscanf(token + i + 1, "%2x", &hex);
+      name[j] = hex;
+      i += 2;
+    } else {
+      name[j] = token[i];
+    }
+  }
+  name[j] = '\0';
+  if (base->name_count == base->name_allocated) {
+    base->name_allocated += 16;
+    base->names = xrealloc(base->names, base->name_allocated * sizeof(char *));
+  }
+  base->names[base->name_count++] = name;
+  return name;
+}
+
+/* An integer, or the start of an indirect reference "n g R". */
+static struct pdf_obj *
+read_number(struct reader *r, int c)
+{
+  long value, pos;
+  value = read_long(r, c);
+  pos = ftell(r->file);
+  c = skip_space(r);
+  if (c >= '0' && c <= '9') {
+    read_long(r, c);
+    if (skip_space(r) == 'R' && is_delimiter(c = getc(r->file))) {
+      if (c != EOF)
+        ungetc(c, r->file);
+      return (struct pdf_obj *)pdf_create_reference(r->pdf, value);
+    }
+  }
+  fseek(r->file, pos, SEEK_SET);
+  return (struct pdf_obj *)pdf_create_integer(r->pdf, value);
+}
+
+static struct pdf_obj *
+read_array(struct reader *r)
+{
+  struct pdf_obj_array *array;
+  struct pdf_obj **values;
+  int c, allocated, count;
+  allocated = count = 0;
+  values = NULL;
+  while ( (c = skip_space(r)) != ']') {
+    if (count == allocated) {
+      allocated = allocated ? allocated * 2 : 64;
+      values = xrealloc(values, allocated * sizeof(struct pdf_obj *));
+    }
+    values[count++] = read_obj(r, c);
+  }
+  array = pdf_create_array(r->pdf);
+  while (count--)
+    array = pdf_prepend_array(r->pdf, array, values[count]);
+  free(values);
+  return (struct pdf_obj *)array;
+}
+
+static struct pdf_obj *
+read_dictionary(struct reader *r)
+{
+  struct pdf_obj_dictionary *dict;
+  struct pdf_obj **values;
+  const char **keys;
+  int c, allocated, count;
+  allocated = count = 0;
+  values = NULL;
+  keys = NULL;
+  while ( (c = skip_space(r)) != '>') {
+    if (c != '/')
+      fail(r, "Expected a name as dictionary key");
+    if (count == allocated) {
+      allocated = allocated ? allocated * 2 : 16;
+      keys = xrealloc(keys, allocated * sizeof(char *));
+      values = xrealloc(values, allocated * sizeof(struct pdf_obj *));
+    }
+    keys[count] = read_name(r);
+    values[count++] = read_obj(r, skip_space(r));
+  }
+  if (getc(r->file) != '>')
+    fail(r, "Unterminated dictionary");
+  dict = pdf_create_dictionary(r->pdf);
+  while (count--)
+    dict = pdf_prepend_dictionary(r->pdf, dict, keys[count], values[count]);
+  free(keys);
+  free(values);
+  return (struct pdf_obj *)dict;
+}
+
+static struct pdf_obj *
+read_obj(struct reader *r, int c)
+{
+  char token[MAX_TOKEN];
+  switch (c) {
+  case '<':
+    if (getc(r->file) != '<')
+      fail(r, "Unsupported hexadecimal string");
+    return read_dictionary(r);
+  case '[':
+    return read_array(r);
+  case '/':
+    return (struct pdf_obj *)pdf_create_name(r->pdf, read_name(r));
+  case '(':
+    fail(r, "Unsupported string");
+  case EOF:
+    fail(r, "Unexpected end of file");
+  }
+  if ((c >= '0' && c <= '9') || c == '-' || c == '+')
+    return read_number(r, c);
+  read_token(r, c, token);
+  if (!strcmp(token, "true"))
+    return (struct pdf_obj *)pdf_create_boolean(r->pdf, 1);
+  if (!strcmp(token, "false"))
+    return (struct pdf_obj *)pdf_create_boolean(r->pdf, 0);
+  fail(r, "Unexpected token");
+  return NULL;
+}
+
+static const struct pdf_obj *
+dict_get(const struct pdf_obj_dictionary *dict, const char *key)
+{
+  for (; dict && dict->key; dict = dict->tail)
+    if (!strcmp(dict->key->string, key))
+      return dict->value;
+  return NULL;
+}
+
+/* Later sections are read first, so the first offset seen for an object wins. */
+static void
+set_offset(struct reader *r, long obj_num, long offset)
+{
+  int allocated;
+  if (obj_num < 0 || obj_num > 0x7fffffff / 2)
+    fail(r, "Bad object number in cross-reference table");
+  if (obj_num >= r->offset_allocated) {
+    allocated = r->offset_allocated ? r->offset_allocated : 64;
+    while (allocated <= obj_num)
+      allocated *= 2;
+    r->offsets = xrealloc(r->offsets, allocated * sizeof(long));
+    memset(r->offsets + r->offset_allocated, 0,
+        (allocated - r->offset_allocated) * sizeof(long));
+    r->offset_allocated = allocated;
+  }
+  if (r->offsets[obj_num] == 0)
+    r->offsets[obj_num] = offset;
+}
+
+/* Reads the section at offset and returns its trailer. */
+static struct pdf_obj_dictionary *
+read_xref_section(struct reader *r, long offset)
+{
+  struct pdf_obj *trailer;
+  long start, count, entry_offset;
+  int c;
+  if (offset < 0 || offset >= r->base->length
+      || fseek(r->file, offset, SEEK_SET))
+    fail(r, "Bad cross-reference offset");
+  c = skip_space(r);
+  if (c >= '0' && c <= '9')
+    fail(r, "Unsupported cross-reference stream");
+  expect_keyword(r, c, "xref");
+  while ( (c = skip_space(r)) != 't') {
+    start = read_long(r, c);
+    count = read_long(r, skip_space(r));
+    for (; count > 0; count--, start++) {
+      entry_offset = read_long(r, skip_space(r));
+      read_long(r, skip_space(r));
+      c = skip_space(r);
+      if (c != 'n' && c != 'f')
+        fail(r, "Bad cross-reference entry");
+      set_offset(r, start, c == 'n' ? entry_offset : -1);
+    }
+  }
+  expect_keyword(r, c, "trailer");
+  trailer = read_obj(r, skip_space(r));
+  if (trailer->type != PDF_OBJ_DICTIONARY)
+    fail(r, "Bad trailer");
+  return (struct pdf_obj_dictionary *)trailer;
+}
+
+static long
+read_startxref(struct reader *r)
+{
+  char tail[TAIL_SIZE + 1], *found, *next;
+  long start, length;
+  start = r->base->length > TAIL_SIZE ? r->base->length - TAIL_SIZE : 0;
+  fseek(r->file, start, SEEK_SET);
+  length = fread(tail, 1, TAIL_SIZE, r->file);
+  tail[length] = '\0';
+  found = NULL;
+  for (next = tail; (next = strstr(next, "startxref")); next++)
+    found = next;
+  if (found == NULL)
+    fail(r, "No startxref");
+  return strtol(found + strlen("startxref"), NULL, 10);
+}
+
+static struct pdf_obj_dictionary *
+read_indirect_dictionary(struct reader *r, int obj_num)
+{
+  struct pdf_obj *obj;
+  if (obj_num >= r->offset_allocated || r->offsets[obj_num] <= 0)
+    fail(r, "Missing object");
+  fseek(r->file, r->offsets[obj_num], SEEK_SET);
+  if (read_long(r, skip_space(r)) != obj_num)
+    fail(r, "Object offset mismatch");
+  read_long(r, skip_space(r));
+  expect_keyword(r, skip_space(r), "obj");
+  obj = read_obj(r, skip_space(r));
+  if (obj->type != PDF_OBJ_DICTIONARY)
+    fail(r, "Expected a dictionary");
+  return (struct pdf_obj_dictionary *)obj;
+}
+
+/*
+ * Reads the trailers, catalogue and page tree root of fname into base, with
+ * objects allocated in pdf. New objects in pdf are numbered after the
+ * existing ones.
+ */
+void
+pdf_read_base(struct pdf *pdf, struct pdf_base *base, const char *fname)
+{
+  struct tw_trap trap;
+  struct reader r;
+  struct pdf_obj_dictionary *trailer, *catalogue;
+  const struct pdf_obj *obj;
+  long offset;
+  int sections;
+
+  memset(base, 0, sizeof(struct pdf_base));
+  r.fname = fname;
+  r.pdf = pdf;
+  r.base = base;
+  r.offset_allocated = 0;
+  r.offsets = NULL;
+  r.file = fopen(fname, "r");
+  if (r.file == NULL)
+    tw_fail(TW_ERR_IO, "twpdf: Failed to open file %s.", fname);
+  tw_push_trap(&trap);
+  if (setjmp(trap.env)) {
+    free(r.offsets);
+    fclose(r.file);
+    tw_rethrow(&trap);
+  }
+  fseek(r.file, 0, SEEK_END);
+  base->length = ftell(r.file);
+
+  /* Follow the chain of sections from the newest. */
+  base->xref_offset = offset = read_startxref(&r);
+  for (sections = 0; offset >= 0; sections++) {
+    if (sections == MAX_XREF_SECTIONS)
+      fail(&r, "Cross-reference sections loop");
+    trailer = read_xref_section(&r, offset);
+    obj = dict_get(trailer, "Size");
+    if (base->size == 0 && obj && obj->type == PDF_OBJ_INTEGER)
+      base->size = ((const struct pdf_obj_integer *)obj)->value;
+    obj = dict_get(trailer, "Root");
+    if (base->root_obj_num == 0 && obj && obj->type == PDF_OBJ_INDIRECT)
+      base->root_obj_num = ((const struct pdf_obj_indirect *)obj)->obj_num;
+    obj = dict_get(trailer, "Prev");
+    offset = obj && obj->type == PDF_OBJ_INTEGER
+        ? ((const struct pdf_obj_integer *)obj)->value : -1;
+  }
+  if (base->size <= 0 || base->root_obj_num <= 0)
+    fail(&r, "Trailer without /Size or /Root");
+
+  catalogue = read_indirect_dictionary(&r, base->root_obj_num);
+  obj = dict_get(catalogue, "Pages");
+  if (obj == NULL || obj->type != PDF_OBJ_INDIRECT)
+    fail(&r, "Catalogue without /Pages");
+  base->pages_obj_num = ((const struct pdf_obj_indirect *)obj)->obj_num;
+  base->pages = read_indirect_dictionary(&r, base->pages_obj_num);
+  obj = dict_get(base->pages, "Kids");
+  if (obj == NULL || obj->type != PDF_OBJ_ARRAY)
+    fail(&r, "Page tree root without /Kids");
+  obj = dict_get(base->pages, "Count");
+  if (obj == NULL || obj->type != PDF_OBJ_INTEGER)
+    fail(&r, "Page tree root without /Count");
+
+  if (pdf->next_obj_num < base->size)
+    pdf->next_obj_num = base->size;
+  pdf->base = base;
+  tw_pop_trap(&trap);
+  free(r.offsets);
+  fclose(r.file);
+}
+
+void
+pdf_free_base(struct pdf_base *base)
+{
+  int i;
+  for (i = 0; i < base->name_count; i++)
+    free(base->names[i]);
+  free(base->names);
+}
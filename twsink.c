@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2023 Christopher Lang
+ * See LICENSE for license details.
+ */
+
+/* For fopencookie. */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "typewriter.h"
+#include "twerror.h"
+#include "twpdf.h"
+
+static ssize_t write_callback(void *cookie, const char *bytes, size_t length);
+static int write_fd(void *arg, const char *bytes, long length);
+static void discard(struct pdf_sink *sink);
+
+static ssize_t
+write_callback(void *cookie, const char *bytes, size_t length)
+{
+  struct pdf_sink *sink;
+  sink = cookie;
+  if (sink->failed || sink->write(sink->arg, bytes, length)) {
+    sink->failed = 1;
+    return -1;
+  }
+  return length;
+}
+
+static int
+write_fd(void *arg, const char *bytes, long length)
+{
+  struct pdf_sink *sink;
+  ssize_t n;
+  sink = arg;
+  while (length > 0) {
+    if ( (n = write(sink->fd, bytes, length)) == -1) {
+      if (errno == EINTR)
+        continue;
+      return 1;
+    }
+    bytes += n;
+    length -= n;
+  }
+  return 0;
+}
+
+/*
+ * Close the stream after a failure, dropping anything written. Marking the
+ * sink failed first keeps what is still buffered from being passed on.
+ */
+static void
+discard(struct pdf_sink *sink)
+{
+  sink->failed = 1;
+  fclose(sink->file);
+  sink->file = NULL;
+  free(sink->bytes);
+  sink->bytes = NULL;
+  sink->length = 0;
+}
+
+/* Collect the output in memory, see pdf_sink_close. */
+void
+pdf_sink_memory(struct pdf_sink *sink)
+{
+  sink->bytes = NULL;
+  sink->length = 0;
+  sink->failed = 0;
+  if ( (sink->file = open_memstream(&sink->bytes, &sink->length)) == NULL)
+    tw_fail(TW_ERR_MEMORY, "twpdf: Failed to open memory stream.");
+}
+
+/* Write to fd, which is left open. */
+void
+pdf_sink_fd(struct pdf_sink *sink, int fd)
+{
+  if (fcntl(fd, F_GETFD) == -1)
+    tw_fail(TW_ERR_IO, "twpdf: Bad file descriptor %d.", fd);
+  sink->fd = fd;
+  pdf_sink_callback(sink, write_fd, sink);
+}
+
+/*
+ * Pass the output to write in the order it is written. write returns
+ * nonzero to stop the output, which then fails. The sink must stay in place
+ * until it is closed.
+ */
+void
+pdf_sink_callback(struct pdf_sink *sink,
+    int (*write)(void *arg, const char *bytes, long length), void *arg)
+{
+  cookie_io_functions_t functions = { NULL, write_callback, NULL, NULL };
+  sink->bytes = NULL;
+  sink->length = 0;
+  sink->write = write;
+  sink->arg = arg;
+  sink->failed = 0;
+  if ( (sink->file = fopencookie(sink, "w", functions)) == NULL)
+    tw_fail(TW_ERR_MEMORY, "twpdf: Failed to open callback stream.");
+}
+
+/*
+ * Flush and close the stream. A memory sink then holds the output in bytes
+ * and length, which the caller frees.
+ */
+void
+pdf_sink_close(struct pdf_sink *sink)
+{
+  if (fflush(sink->file) || ferror(sink->file)) {
+    discard(sink);
+    tw_fail(TW_ERR_IO, "twpdf: Error writing pdf.");
+  }
+  fclose(sink->file);
+  sink->file = NULL;
+}
+
+/* Write the pdf to an open sink and close it, even if writing fails. */
+void
+pdf_write_sink(struct pdf *pdf, struct pdf_sink *sink)
+{
+  struct tw_trap trap;
+  tw_push_trap(&trap);
+  if (setjmp(trap.env)) {
+    discard(sink);
+    tw_rethrow(&trap);
+  }
+  pdf_write_file(pdf, sink->file);
+  tw_pop_trap(&trap);
+  pdf_sink_close(sink);
+}
@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2023 Christopher Lang
+ * See LICENSE for license details.
+ */
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "typewriter.h"
+#include "twerror.h"
+#include "twpdf.h"
+
+/* How many of the largest pages and images are listed. */
+#define STATS_LARGEST 5
+
+static const char *const kind_names[PDF_KIND_COUNT] = {
+  "other", "content", "image", "form", "page", "page_tree", "xref",
+};
+
+static enum pdf_kind kind_of(const struct pdf_obj *obj);
+static int template_value(const struct pdf_obj *obj, const char *key);
+static void add_obj(struct pdf_stats_obj **objs, int *count, int *allocated,
+    int obj_num, int written_num, long bytes, const struct pdf_obj *obj);
+static int by_order(const void *a, const void *b);
+static int by_bytes(const void *a, const void *b);
+
+static enum pdf_kind
+kind_of(const struct pdf_obj *obj)
+{
+  const struct pdf_obj_dictionary *entry;
+  const struct pdf_obj_name *type;
+  switch (obj->type) {
+  case PDF_OBJ_STREAM:
+    return kind_of(((const struct pdf_obj_stream *)obj)->dictionary);
+  case PDF_OBJ_TEMPLATE:
+    return ((const struct pdf_obj_template *)obj)->tmpl->kind;
+  case PDF_OBJ_DICTIONARY:
+    for (entry = (const struct pdf_obj_dictionary *)obj; entry->key;
+        entry = entry->tail) {
+      if (strcmp(entry->key->string, "Type") || entry->value->type != PDF_OBJ_NAME)
+        continue;
+      type = (const struct pdf_obj_name *)entry->value;
+      if (!strcmp(type->string, "Pages") || !strcmp(type->string, "Catalog"))
+        return PDF_KIND_PAGE_TREE;
+    }
+    return PDF_KIND_OTHER;
+  default:
+    return PDF_KIND_OTHER;
+  }
+}
+
+/* The value of a template's integer hole for key, or 0. */
+static int
+template_value(const struct pdf_obj *obj, const char *key)
+{
+  const struct pdf_obj_template *template;
+  int i;
+  if (obj->type != PDF_OBJ_TEMPLATE)
+    return 0;
+  template = (const struct pdf_obj_template *)obj;
+  for (i = 0; i < template->tmpl->hole_count; i++)
+    if (!strcmp(template->tmpl->keys[i], key))
+      return template->values[i];
+  return 0;
+}
+
+static void
+add_obj(struct pdf_stats_obj **objs, int *count, int *allocated, int obj_num,
+    int written_num, long bytes, const struct pdf_obj *obj)
+{
+  struct pdf_stats_obj *entry;
+  if (*count == *allocated) {
+    *allocated = *allocated ? *allocated * 2 : 64;
+    *objs = xrealloc(*objs, *allocated * sizeof(struct pdf_stats_obj));
+  }
+  entry = &(*objs)[(*count)++];
+  entry->obj_num = written_num;
+  entry->order = obj_num;
+  entry->bytes = bytes;
+  entry->page = 0;
+  entry->width = template_value(obj, "Width");
+  entry->height = template_value(obj, "Height");
+}
+
+static int
+by_order(const void *a, const void *b)
+{
+  return ((const struct pdf_stats_obj *)a)->order
+    - ((const struct pdf_stats_obj *)b)->order;
+}
+
+/* Largest first, then in the order defined. */
+static int
+by_bytes(const void *a, const void *b)
+{
+  const struct pdf_stats_obj *x = a, *y = b;
+  if (x->bytes != y->bytes)
+    return x->bytes < y->bytes ? 1 : -1;
+  return x->order - y->order;
+}
+
+void
+pdf_stats_init(struct pdf_stats *stats)
+{
+  memset(stats, 0, sizeof(struct pdf_stats));
+}
+
+void
+pdf_stats_free(struct pdf_stats *stats)
+{
+  free(stats->contents);
+  free(stats->images);
+}
+
+/*
+ * Count an object written as length bytes, from "n 0 obj" to "endobj", if the
+ * pdf is counted. obj_num is its number as defined, and written_num the one
+ * in the file, which differ only in linearized files.
+ */
+void
+pdf_stats_count_obj(struct pdf *pdf, int obj_num, int written_num,
+    const struct pdf_obj *obj, long length)
+{
+  struct pdf_stats *stats;
+  const struct pdf_obj_stream *stream;
+  enum pdf_kind kind;
+  if ( (stats = pdf->stats) == NULL)
+    return;
+  kind = kind_of(obj);
+  pdf_stats_count(pdf, kind, length);
+  if (obj->type != PDF_OBJ_STREAM)
+    return;
+  stream = (const struct pdf_obj_stream *)obj;
+  stats->stream_bytes[kind] += stream->size;
+  stats->encoded_bytes[kind] += pdf_encoded_length(stream->ascii85,
+      stream->size);
+  if (kind == PDF_KIND_CONTENT)
+    add_obj(&stats->contents, &stats->content_count, &stats->content_allocated,
+        obj_num, written_num, length, stream->dictionary);
+  else if (kind == PDF_KIND_IMAGE)
+    add_obj(&stats->images, &stats->image_count, &stats->image_allocated,
+        obj_num, written_num, length, stream->dictionary);
+}
+
+/* Count length bytes of kind that aren't an object of the pdf. */
+void
+pdf_stats_count(struct pdf *pdf, enum pdf_kind kind, long length)
+{
+  if (pdf->stats == NULL)
+    return;
+  pdf->stats->ascii85 = pdf->ascii85;
+  pdf->stats->counts[kind]++;
+  pdf->stats->bytes[kind] += length;
+}
+
+/*
+ * Print the counts as JSON. Pages are numbered from 1 in the order their
+ * contents were defined, which is the order of the pages.
+ */
+void
+pdf_stats_write_file(struct pdf_stats *stats, FILE *file)
+{
+  long stream_bytes, encoded_bytes;
+  int i;
+  qsort(stats->contents, stats->content_count, sizeof(struct pdf_stats_obj),
+      by_order);
+  for (i = 0; i < stats->content_count; i++)
+    stats->contents[i].page = i + 1;
+  qsort(stats->contents, stats->content_count, sizeof(struct pdf_stats_obj),
+      by_bytes);
+  qsort(stats->images, stats->image_count, sizeof(struct pdf_stats_obj),
+      by_bytes);
+  stream_bytes = encoded_bytes = 0;
+  fprintf(file, "{\n  \"file_bytes\": %ld,\n  \"kinds\": {\n",
+      stats->file_bytes);
+  for (i = 0; i < PDF_KIND_COUNT; i++) {
+    fprintf(file, "    \"%s\": { \"count\": %d, \"bytes\": %ld", kind_names[i],
+        stats->counts[i], stats->bytes[i]);
+    if (stats->stream_bytes[i] || stats->encoded_bytes[i])
+      fprintf(file, ", \"stream_bytes\": %ld, \"encoded_bytes\": %ld",
+          stats->stream_bytes[i], stats->encoded_bytes[i]);
+    fprintf(file, " }%s\n", i + 1 < PDF_KIND_COUNT ? "," : "");
+    stream_bytes += stats->stream_bytes[i];
+    encoded_bytes += stats->encoded_bytes[i];
+  }
+  fprintf(file, "  },\n  \"encoding\": { \"filter\": \"%s\", "
+      "\"stream_bytes\": %ld, \"encoded_bytes\": %ld, \"overhead_bytes\": %ld },\n",
+      stats->ascii85 ? "ASCII85Decode" : "ASCIIHexDecode", stream_bytes,
+      encoded_bytes, encoded_bytes - stream_bytes);
+  fprintf(file, "  \"largest_pages\": [");
+  for (i = 0; i < stats->content_count && i < STATS_LARGEST; i++)
+    fprintf(file, "%s\n    { \"page\": %d, \"object\": %d, \"bytes\": %ld }",
+        i ? "," : "", stats->contents[i].page, stats->contents[i].obj_num,
+        stats->contents[i].bytes);
+  fprintf(file, "%s],\n  \"largest_images\": [", i ? "\n  " : "");
+  for (i = 0; i < stats->image_count && i < STATS_LARGEST; i++)
+    fprintf(file, "%s\n    { \"object\": %d, \"bytes\": %ld, \"width\": %d, "
+        "\"height\": %d }", i ? "," : "", stats->images[i].obj_num,
+        stats->images[i].bytes, stats->images[i].width,
+        stats->images[i].height);
+  fprintf(file, "%s]\n}\n", i ? "\n  " : "");
+}
+
+/* Print the counts to fname, "-" for standard output. */
+void
+pdf_stats_write(struct pdf_stats *stats, const char *fname)
+{
+  FILE *file;
+  if (strcmp(fname, "-") == 0) {
+    pdf_stats_write_file(stats, stdout);
+    if (fflush(stdout) || ferror(stdout))
+      tw_fail(TW_ERR_IO, "twpdf: Error writing to standard output.");
+    return;
+  }
+  if ( (file = fopen(fname, "w")) == NULL)
+    tw_fail(TW_ERR_IO, "twpdf: Failed to open file %s.", fname);
+  pdf_stats_write_file(stats, file);
+  if (fflush(file) || ferror(file)) {
+    fclose(file);
+    tw_fail(TW_ERR_IO, "twpdf: Error writing file %s.", fname);
+  }
+  fclose(file);
+}
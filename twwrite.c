@@ -3,231 +3,1227 @@
  * See LICENSE for license details.
  */
 
+#include <setjmp.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "utils.h"
+#include "typewriter.h"
+#include "twerror.h"
 #include "twpdf.h"
+#include "twescape.h"
 
-static void write_obj_boolean(FILE *file, const struct pdf_obj_boolean *obj);
-static void write_obj_integer(FILE *file, const struct pdf_obj_integer *obj);
-static void write_obj_string(FILE *file, const struct pdf_obj_string *obj);
-static void write_obj_name(FILE *file, const struct pdf_obj_name *obj);
-static void write_obj_array(FILE *file, const struct pdf_obj_array *obj);
-static void write_obj_dictionary(FILE *file, const struct pdf_obj_dictionary *obj);
-static void write_obj_stream(FILE *file, const struct pdf_obj_stream *obj);
-static void write_obj_null(FILE *file);
-static void write_obj_indirect(FILE *file, const struct pdf_obj_indirect *obj);
-static void write_obj(FILE *file, const struct pdf_obj *obj);
+/*
+ * Where objects are written. The writer counts the bytes itself rather than
+ * asking the file, so that pipes work too. With no file, the bytes are only
+ * counted. When obj_nums is set, indirect references are renumbered through
+ * it.
+ */
+struct pdf_writer {
+  FILE *file;
+  long offset;
+  const int *obj_nums;
+};
+
+static void check_write(struct pdf_writer *w);
+static void put_bytes(struct pdf_writer *w, const char *bytes, size_t length);
+static void put_char(struct pdf_writer *w, int c);
+static void put_format(struct pdf_writer *w, const char *format, ...);
 
+static void write_obj_boolean(struct pdf_writer *w, const struct pdf_obj_boolean *obj);
+static void write_obj_integer(struct pdf_writer *w, const struct pdf_obj_integer *obj);
+static void write_obj_string(struct pdf_writer *w, const struct pdf_obj_string *obj);
+static void write_obj_name(struct pdf_writer *w, const struct pdf_obj_name *obj);
+static void write_obj_array(struct pdf_writer *w, const struct pdf_obj_array *obj);
+static void write_obj_dictionary(struct pdf_writer *w, const struct pdf_obj_dictionary *obj);
+static long encode_hex(char *out, const unsigned char *in, long length);
+static void encode_ascii85_group(char *out, unsigned long group);
+static long encode_ascii85(char *out, const unsigned char *in, long length);
+static void write_obj_stream(struct pdf_writer *w, const struct pdf_obj_stream *obj);
+static void write_obj_null(struct pdf_writer *w);
+static void write_obj_indirect(struct pdf_writer *w, const struct pdf_obj_indirect *obj);
+static void write_obj_template(struct pdf_writer *w, const struct pdf_obj_template *obj);
+static void write_obj(struct pdf_writer *w, const struct pdf_obj *obj);
+
+/* Stop at the first failed write, rather than serialising the rest. */
 static void
-write_obj_boolean(FILE *file, const struct pdf_obj_boolean *obj)
+check_write(struct pdf_writer *w)
 {
-  fprintf(file, obj ? "true" : "false");
+  if (w->file && ferror(w->file))
+    tw_fail(TW_ERR_IO, "twpdf: Error writing pdf.");
 }
 
 static void
-write_obj_integer(FILE *file, const struct pdf_obj_integer *obj)
+put_bytes(struct pdf_writer *w, const char *bytes, size_t length)
 {
-  fprintf(file, "%d", obj->value);
+  if (w->file)
+    fwrite(bytes, 1, length, w->file);
+  w->offset += length;
+  check_write(w);
 }
 
 static void
-write_obj_string(FILE *file, const struct pdf_obj_string *obj)
+put_char(struct pdf_writer *w, int c)
 {
-  const unsigned char *c;
-  fputc('(', file);
-  for (c = (const unsigned char *)obj->string; *c; c++) {
-    if (*c > 127) {
-      fprintf(stderr, "twpdf: Non-ASCII characters are not supported.\n");
-      exit(1);
-    }
-    switch (*c) {
-    case '(':
-    case ')':
-    case '\\':
-      fputc('\\', file);
-    default:
-      fputc(*c, file);
-    }
+  if (w->file)
+    putc(c, w->file);
+  w->offset++;
+  check_write(w);
+}
+
+static void
+put_format(struct pdf_writer *w, const char *format, ...)
+{
+  va_list ap;
+  int n;
+  va_start(ap, format);
+  n = w->file ? vfprintf(w->file, format, ap) : vsnprintf(NULL, 0, format, ap);
+  va_end(ap);
+  if (n > 0)
+    w->offset += n;
+  check_write(w);
+}
+
+static void
+write_obj_boolean(struct pdf_writer *w, const struct pdf_obj_boolean *obj)
+{
+  put_format(w, obj->value ? "true" : "false");
+}
+
+static void
+write_obj_integer(struct pdf_writer *w, const struct pdf_obj_integer *obj)
+{
+  put_format(w, "%d", obj->value);
+}
+
+static void
+write_obj_string(struct pdf_writer *w, const struct pdf_obj_string *obj)
+{
+  const char *string;
+  long length, run;
+  put_char(w, '(');
+  string = obj->string;
+  for (length = obj->length; ; length -= run + 1) {
+    run = pdf_string_run(string, length);
+    put_bytes(w, string, run);
+    if (run == length)
+      break;
+    put_char(w, '\\');
+    put_char(w, string[run]);
+    string += run + 1;
   }
-  fputc(')', file);
+  put_char(w, ')');
 }
 
 static void
-write_obj_name(FILE *file, const struct pdf_obj_name *obj)
+write_obj_name(struct pdf_writer *w, const struct pdf_obj_name *obj)
 {
-  const unsigned char *c;
-  fputc('/', file);
-  for (c = (const unsigned char *)obj->string; *c; c++) {
-    if (*c > 127) {
-      fprintf(stderr, "twpdf: Non-ASCII characters are not supported.\n");
-      exit(1);
-    }
-    switch (*c) {
-    case '\t':
-    case '\n':
-    case '\f':
-    case '\r':
-    case ' ':
-    case '(':
-    case ')':
-    case '<':
-    case '>':
-    case '[':
-    case ']':
-    case '{':
-    case '}':
-    case '/':
-    case '%':
-    case '#':
-      fprintf(file, "#%02x", *c);
+  const char *string;
+  long length, run;
+  put_char(w, '/');
+  string = obj->string;
+  for (length = strlen(string); ; length -= run + 1) {
+    run = pdf_name_run(string, length);
+    put_bytes(w, string, run);
+    if (run == length)
       break;
-    default:
-      fputc(*c, file);
-    }
+    put_format(w, "#%02x", (unsigned char)string[run]);
+    string += run + 1;
   }
 }
 
 static void
-write_obj_array(FILE *file, const struct pdf_obj_array *obj)
+write_obj_array(struct pdf_writer *w, const struct pdf_obj_array *obj)
 {
-  fputc('[', file);
+  put_char(w, '[');
   for (; obj->value; obj = obj->tail) {
-    write_obj(file, obj->value);
+    write_obj(w, obj->value);
     if (obj->tail->value)
-      fputc('\n', file);
+      put_char(w, '\n');
   }
-  fputc(']', file);
+  put_char(w, ']');
 }
 
 static void
-write_obj_dictionary(FILE *file, const struct pdf_obj_dictionary *obj)
+write_obj_dictionary(struct pdf_writer *w, const struct pdf_obj_dictionary *obj)
 {
-  fprintf(file, "<< ");
+  put_format(w, "<< ");
   for (; obj->key; obj = obj->tail) {
-    write_obj_name(file, obj->key);
-    fputc(' ', file);
-    write_obj(file, obj->value);
-    fputc('\n', file);
+    write_obj_name(w, obj->key);
+    put_char(w, ' ');
+    write_obj(w, obj->value);
+    put_char(w, '\n');
   }
-  fprintf(file, ">>");
+  put_format(w, ">>");
 }
 
-static void
-write_obj_stream(FILE *file, const struct pdf_obj_stream *obj)
+static long
+encode_hex(char *out, const unsigned char *in, long length)
 {
+  static const char hex[] = "0123456789abcdef";
   long i;
-  write_obj_dictionary(file, obj->dictionary);
-  fprintf(file, "\nstream\n");
-  for (i = 0; i < obj->size; i++)
-    fprintf(file, "%02x", (unsigned char)obj->bytes[i]);
-  fprintf(file, "\nendstream");
+  for (i = 0; i < length; i++) {
+    out[2 * i] = hex[in[i] >> 4];
+    out[2 * i + 1] = hex[in[i] & 0xf];
+  }
+  return 2 * length;
+}
+
+static void
+encode_ascii85_group(char *out, unsigned long group)
+{
+  int k;
+  for (k = 4; k >= 0; k--) {
+    out[k] = '!' + group % 85;
+    group /= 85;
+  }
+}
+
+/*
+ * Groups are encoded four at a time so their divisions can overlap. Only the
+ * last call for a stream may end with a partial group.
+ */
+static long
+encode_ascii85(char *out, const unsigned char *in, long length)
+{
+  unsigned long group[4];
+  char last[5];
+  long i, n;
+  int j, k;
+  n = 0;
+  for (i = 0; i + 16 <= length; i += 16, n += 20) {
+    for (j = 0; j < 4; j++)
+      group[j] = (unsigned long)in[i + 4 * j] << 24 | in[i + 4 * j + 1] << 16
+        | in[i + 4 * j + 2] << 8 | in[i + 4 * j + 3];
+    for (k = 4; k >= 0; k--) {
+      for (j = 0; j < 4; j++) {
+        out[n + 5 * j + k] = '!' + group[j] % 85;
+        group[j] /= 85;
+      }
+    }
+  }
+  for (; i + 4 <= length; i += 4, n += 5)
+    encode_ascii85_group(out + n, (unsigned long)in[i] << 24
+        | in[i + 1] << 16 | in[i + 2] << 8 | in[i + 3]);
+  if (i < length) {
+    /* Padded with zeros, keeping one more character than there are bytes. */
+    group[0] = 0;
+    for (j = 0; j < 4; j++)
+      group[0] = group[0] << 8 | (i + j < length ? in[i + j] : 0);
+    encode_ascii85_group(last, group[0]);
+    memcpy(out + n, last, length - i + 1);
+    n += length - i + 1;
+  }
+  return n;
 }
 
 static void
-write_obj_null(FILE *file)
+write_obj_stream(struct pdf_writer *w, const struct pdf_obj_stream *obj)
 {
-  fprintf(file, "null");
+  char spilled[2048], buffer[2 * sizeof(spilled)];
+  const char *bytes;
+  long i, n;
+  write_obj(w, obj->dictionary);
+  put_format(w, "\nstream\n");
+  if (w->file == NULL) {
+    /* The length is known without reading spilled bytes back. */
+    w->offset += pdf_encoded_length(obj->ascii85, obj->size);
+    put_format(w, "\nendstream");
+    return;
+  }
+  /* Chunks are a whole number of ASCII85 groups. */
+  for (i = 0; i < obj->size; i += n) {
+    n = obj->size - i;
+    if (n > (long)sizeof(spilled))
+      n = sizeof(spilled);
+    if (obj->bytes) {
+      bytes = obj->bytes + i;
+    } else {
+      pdf_read_spilled(obj, i, spilled, n);
+      bytes = spilled;
+    }
+    if (obj->ascii85)
+      put_bytes(w, buffer,
+          encode_ascii85(buffer, (const unsigned char *)bytes, n));
+    else
+      put_bytes(w, buffer, encode_hex(buffer, (const unsigned char *)bytes, n));
+  }
+  if (obj->ascii85)
+    put_format(w, "~>");
+  put_format(w, "\nendstream");
 }
 
 static void
-write_obj_indirect(FILE *file, const struct pdf_obj_indirect *obj)
+write_obj_null(struct pdf_writer *w)
 {
-  fprintf(file, "%d 0 R", obj->obj_num);
+  put_format(w, "null");
 }
 
+static void
+write_obj_indirect(struct pdf_writer *w, const struct pdf_obj_indirect *obj)
+{
+  put_format(w, "%d 0 R",
+      w->obj_nums ? w->obj_nums[obj->obj_num] : obj->obj_num);
+}
 
 static void
-write_obj(FILE *file, const struct pdf_obj *obj)
+write_obj_template(struct pdf_writer *w, const struct pdf_obj_template *obj)
+{
+  const struct pdf_template *tmpl;
+  int i, n;
+  tmpl = obj->tmpl;
+  for (i = 0; i < tmpl->hole_count; i++) {
+    put_bytes(w, tmpl->pieces[i].bytes, tmpl->pieces[i].length);
+    n = obj->values[i];
+    if (tmpl->holes[i] == PDF_HOLE_REFERENCE)
+      put_format(w, "%d 0 R", w->obj_nums ? w->obj_nums[n] : n);
+    else
+      put_format(w, "%d", n);
+  }
+  put_bytes(w, tmpl->pieces[i].bytes, tmpl->pieces[i].length);
+}
+
+static void
+write_obj(struct pdf_writer *w, const struct pdf_obj *obj)
 {
   switch (obj->type) {
   case PDF_OBJ_BOOLEAN:
-    write_obj_boolean(file, (struct pdf_obj_boolean *)obj);
+    write_obj_boolean(w, (struct pdf_obj_boolean *)obj);
     break;
   case PDF_OBJ_INTEGER:
-    write_obj_integer(file, (struct pdf_obj_integer *)obj);
+    write_obj_integer(w, (struct pdf_obj_integer *)obj);
     break;
   case PDF_OBJ_STRING:
-    write_obj_string(file, (struct pdf_obj_string *)obj);
+    write_obj_string(w, (struct pdf_obj_string *)obj);
     break;
   case PDF_OBJ_NAME:
-    write_obj_name(file, (struct pdf_obj_name *)obj);
+    write_obj_name(w, (struct pdf_obj_name *)obj);
     break;
   case PDF_OBJ_ARRAY:
-    write_obj_array(file, (struct pdf_obj_array *)obj);
+    write_obj_array(w, (struct pdf_obj_array *)obj);
     break;
   case PDF_OBJ_DICTIONARY:
-    write_obj_dictionary(file, (struct pdf_obj_dictionary *)obj);
+    write_obj_dictionary(w, (struct pdf_obj_dictionary *)obj);
     break;
   case PDF_OBJ_STREAM:
-    write_obj_stream(file, (struct pdf_obj_stream *)obj);
+    write_obj_stream(w, (struct pdf_obj_stream *)obj);
     break;
   case PDF_OBJ_NULL:
-    write_obj_null(file);
+    write_obj_null(w);
     break;
   case PDF_OBJ_INDIRECT:
-    write_obj_indirect(file, (struct pdf_obj_indirect *)obj);
+    write_obj_indirect(w, (struct pdf_obj_indirect *)obj);
+    break;
+  case PDF_OBJ_TEMPLATE:
+    write_obj_template(w, (struct pdf_obj_template *)obj);
     break;
   default:
-    fprintf(stderr, "twpdf: Unknown object type %d.\n", obj->type);
-    exit(1);
+    tw_fail(TW_ERR_INVALID, "twpdf: Unknown object type %d.", obj->type);
   }
 }
 
-void
-pdf_write(struct pdf *pdf, const char *fname)
+/*
+ * Linearized files (Annex F) are laid out in memory first. Objects are
+ * renumbered and ordered as: linearization dictionary, first page
+ * cross-reference section, catalogue, hint stream, the first page and
+ * everything it uses, the remaining pages each followed by the objects only
+ * they use, objects shared by later pages, then everything else.
+ */
+
+#define LIN_UNSEEN -1
+#define LIN_SHARED -2
+
+struct lin_page {
+  int obj_num;
+  int *objs;            /* Objects first reached from this page. */
+  int obj_count, obj_allocated;
+  int *shared;          /* Objects also reached from another page. */
+  int shared_count, shared_allocated;
+};
+
+struct lin_obj {
+  int obj_num;          /* Number in the written file. */
+  const struct pdf_obj *obj;
+  long length;
+  long offset;          /* As if the hint stream were not present. */
+};
+
+struct lin {
+  const struct pdf *pdf;
+  struct pdf_indirect_obj_def **defs;
+  int *owner, *first_page, *stamp;
+  struct lin_page *pages;
+  int page_count;
+};
+
+struct bit_writer {
+  unsigned char *bytes;
+  long length, allocated;
+  int bit_count;
+};
+
+static void append_int(int **list, int *count, int *allocated, int n);
+static const struct pdf_obj *dict_get(const struct pdf_obj *obj, const char *key);
+static int ref_get(const struct pdf_obj *obj, const char *key);
+static const struct pdf_obj *resolve(const struct lin *lin, const struct pdf_obj *obj);
+static void lin_walk(struct lin *lin, const struct pdf_obj *obj, int page);
+static void lin_visit(struct lin *lin, int obj_num, int page);
+static long write_lin_obj(FILE *file, const int *obj_nums, int obj_num,
+    const struct pdf_obj *obj);
+static void put_bits(struct bit_writer *bw, unsigned long value, int bits);
+static void flush_bits(struct bit_writer *bw);
+static int bits_needed(unsigned long value);
+static char *format_lin_dict(int obj_num, long file_length, long hint_offset,
+    long hint_length, int first_page_num, long first_page_end, int page_count,
+    long main_xref_entry, size_t *length);
+static void write_linearized(struct pdf *pdf, FILE *file);
+static void write_update(struct pdf *pdf, FILE *file);
+static void grow_obj_offsets(struct pdf_output *out, int obj_count);
+static void write_xref(struct pdf_writer *w, struct pdf *pdf,
+    const long *obj_offsets);
+
+static void
+append_int(int **list, int *count, int *allocated, int n)
 {
-  FILE *file;
+  if (*count == *allocated) {
+    *allocated = *allocated ? *allocated * 2 : 16;
+    *list = xrealloc(*list, *allocated * sizeof(int));
+  }
+  (*list)[(*count)++] = n;
+}
+
+static const struct pdf_obj *
+dict_get(const struct pdf_obj *obj, const char *key)
+{
+  const struct pdf_obj_dictionary *dict;
+  if (obj == NULL || obj->type != PDF_OBJ_DICTIONARY)
+    return NULL;
+  for (dict = (const struct pdf_obj_dictionary *)obj; dict->key; dict = dict->tail)
+    if (strcmp(dict->key->string, key) == 0)
+      return dict->value;
+  return NULL;
+}
+
+/* The object number a dictionary or template refers to by key, or 0. */
+static int
+ref_get(const struct pdf_obj *obj, const char *key)
+{
+  const struct pdf_obj_template *t;
+  int i;
+  if (obj && obj->type == PDF_OBJ_TEMPLATE) {
+    t = (const struct pdf_obj_template *)obj;
+    for (i = 0; i < t->tmpl->hole_count; i++)
+      if (t->tmpl->holes[i] == PDF_HOLE_REFERENCE
+          && strcmp(t->tmpl->keys[i], key) == 0)
+        return t->values[i];
+    return 0;
+  }
+  obj = dict_get(obj, key);
+  if (obj == NULL || obj->type != PDF_OBJ_INDIRECT)
+    return 0;
+  return ((const struct pdf_obj_indirect *)obj)->obj_num;
+}
+
+static const struct pdf_obj *
+resolve(const struct lin *lin, const struct pdf_obj *obj)
+{
+  int obj_num;
+  if (obj == NULL || obj->type != PDF_OBJ_INDIRECT)
+    return obj;
+  obj_num = ((const struct pdf_obj_indirect *)obj)->obj_num;
+  return lin->defs[obj_num] ? lin->defs[obj_num]->obj : NULL;
+}
+
+/* Visit the objects referenced by obj, not following page parents. */
+static void
+lin_walk(struct lin *lin, const struct pdf_obj *obj, int page)
+{
+  const struct pdf_obj_array *array;
+  const struct pdf_obj_dictionary *dict;
+  const struct pdf_obj_template *t;
+  int i;
+  switch (obj->type) {
+  case PDF_OBJ_ARRAY:
+    for (array = (const struct pdf_obj_array *)obj; array->value; array = array->tail)
+      lin_walk(lin, array->value, page);
+    break;
+  case PDF_OBJ_DICTIONARY:
+    for (dict = (const struct pdf_obj_dictionary *)obj; dict->key; dict = dict->tail)
+      if (strcmp(dict->key->string, "Parent") != 0)
+        lin_walk(lin, dict->value, page);
+    break;
+  case PDF_OBJ_STREAM:
+    lin_walk(lin, ((const struct pdf_obj_stream *)obj)->dictionary, page);
+    break;
+  case PDF_OBJ_TEMPLATE:
+    t = (const struct pdf_obj_template *)obj;
+    for (i = 0; i < t->tmpl->hole_count; i++)
+      if (t->tmpl->holes[i] == PDF_HOLE_REFERENCE
+          && strcmp(t->tmpl->keys[i], "Parent") != 0)
+        lin_visit(lin, t->values[i], page);
+    break;
+  case PDF_OBJ_INDIRECT:
+    lin_visit(lin, ((const struct pdf_obj_indirect *)obj)->obj_num, page);
+    break;
+  default:
+    break;
+  }
+}
+
+static void
+lin_visit(struct lin *lin, int obj_num, int page)
+{
+  struct lin_page *p;
+  if (lin->defs[obj_num] == NULL || lin->stamp[obj_num] == page)
+    return;
+  lin->stamp[obj_num] = page;
+  p = &lin->pages[page];
+  if (lin->first_page[obj_num] == LIN_UNSEEN) {
+    lin->first_page[obj_num] = page;
+    lin->owner[obj_num] = page;
+    append_int(&p->objs, &p->obj_count, &p->obj_allocated, obj_num);
+  } else {
+    lin->owner[obj_num] = LIN_SHARED;
+    append_int(&p->shared, &p->shared_count, &p->shared_allocated, obj_num);
+  }
+  lin_walk(lin, lin->defs[obj_num]->obj, page);
+}
+
+/*
+ * Write obj as object obj_num, renumbering references through obj_nums.
+ * Returns its length, which is all that happens when file is NULL.
+ */
+static long
+write_lin_obj(FILE *file, const int *obj_nums, int obj_num,
+    const struct pdf_obj *obj)
+{
+  struct pdf_writer w;
+  w.obj_nums = obj_nums;
+  w.file = file;
+  w.offset = 0;
+  put_format(&w, "%d 0 obj\n", obj_num);
+  write_obj(&w, obj);
+  put_format(&w, "\nendobj\n");
+  return w.offset;
+}
+
+static void
+put_bits(struct bit_writer *bw, unsigned long value, int bits)
+{
+  while (bits--) {
+    if (bw->bit_count == 0) {
+      if (bw->length == bw->allocated) {
+        bw->allocated = bw->allocated ? bw->allocated * 2 : 256;
+        bw->bytes = xrealloc(bw->bytes, bw->allocated);
+      }
+      bw->bytes[bw->length++] = 0;
+    }
+    if ((value >> bits) & 1)
+      bw->bytes[bw->length - 1] |= 0x80 >> bw->bit_count;
+    bw->bit_count = (bw->bit_count + 1) % 8;
+  }
+}
+
+/* Hint table items start on a byte boundary. */
+static void
+flush_bits(struct bit_writer *bw)
+{
+  bw->bit_count = 0;
+}
+
+static int
+bits_needed(unsigned long value)
+{
+  int bits;
+  for (bits = 0; value; value >>= 1)
+    bits++;
+  return bits;
+}
+
+/* Numbers are padded so the dictionary has the same length on every pass. */
+static char *
+format_lin_dict(int obj_num, long file_length, long hint_offset,
+    long hint_length, int first_page_num, long first_page_end, int page_count,
+    long main_xref_entry, size_t *length)
+{
+  char *bytes;
+  bytes = xmalloc(256);
+  *length = sprintf(bytes, "%d 0 obj\n<< /Linearized 1 /L %-10ld /H [%-10ld %-10ld] "
+      "/O %-10d /E %-10ld /N %-10d /T %-10ld >>\nendobj\n", obj_num,
+      file_length, hint_offset, hint_length, first_page_num, first_page_end,
+      page_count, main_xref_entry);
+  return bytes;
+}
+
+static void
+write_linearized(struct pdf *pdf, FILE *file)
+{
+  struct lin lin;
+  struct pdf_indirect_obj_def *def;
+  const struct pdf_obj *pages_root, *kids;
+  const struct pdf_obj_array *kid;
+  struct lin_obj *objs, catalogue, hint;
+  struct lin_page *page;
+  struct bit_writer bw;
+  struct pdf_obj_dictionary *hint_dict;
+  int *obj_nums, *shared_index;
+  int i, j, k, obj_count, first_count, rest_count, first_num, shared_count;
+  int contents;
+  int part6_count, part8_start, part9_start, min_objs, max_objs, max_shared, *page_objs;
+  long *page_offsets, *page_lengths, *content_offsets, *content_lengths;
+  long offset, min_len, max_len, min_coff, max_coff, min_clen, max_clen;
+  long shared_table_offset, first_xref_offset, main_xref_offset;
+  long file_length, hint_offset, first_page_end;
+  size_t lin_length, first_xref_length, main_xref_length;
+  char *lin_bytes, *first_xref, *main_xref;
+  FILE *xref;
+
+  lin.pdf = pdf;
+  lin.defs = xmalloc(pdf->next_obj_num * sizeof(struct pdf_indirect_obj_def *));
+  lin.owner = xmalloc(pdf->next_obj_num * sizeof(int));
+  lin.first_page = xmalloc(pdf->next_obj_num * sizeof(int));
+  lin.stamp = xmalloc(pdf->next_obj_num * sizeof(int));
+  for (i = 0; i < pdf->next_obj_num; i++) {
+    lin.defs[i] = NULL;
+    lin.owner[i] = lin.first_page[i] = lin.stamp[i] = LIN_UNSEEN;
+  }
+  for (def = pdf->defs; def; def = def->next)
+    lin.defs[def->obj_num] = def;
+
+  /* Find the pages and the objects each one uses. */
+  pages_root = dict_get(pdf->root->obj, "Pages");
+  if (pages_root == NULL || pages_root->type != PDF_OBJ_INDIRECT)
+    tw_fail(TW_ERR_INVALID, "twpdf: Cant linearize pdf without a page tree.");
+  kids = resolve(&lin, dict_get(resolve(&lin, pages_root), "Kids"));
+  lin.page_count = 0;
+  for (kid = (const struct pdf_obj_array *)kids; kid && kid->value; kid = kid->tail)
+    lin.page_count++;
+  if (lin.page_count == 0)
+    tw_fail(TW_ERR_INVALID, "twpdf: Cant linearize pdf without pages.");
+  lin.pages = xmalloc(lin.page_count * sizeof(struct lin_page));
+  for (i = 0, kid = (const struct pdf_obj_array *)kids; i < lin.page_count;
+      i++, kid = kid->tail) {
+    page = &lin.pages[i];
+    page->obj_num = ((const struct pdf_obj_indirect *)kid->value)->obj_num;
+    page->objs = page->shared = NULL;
+    page->obj_count = page->obj_allocated = 0;
+    page->shared_count = page->shared_allocated = 0;
+    lin_visit(&lin, page->obj_num, i);
+  }
+  lin.owner[pdf->root->obj_num] = LIN_SHARED;
+
+  /* Order the objects that are not in the first page section. */
+  objs = xmalloc(pdf->next_obj_num * sizeof(struct lin_obj));
+  obj_count = 0;
+  for (i = 1; i < lin.page_count; i++)
+    for (j = 0; j < lin.pages[i].obj_count; j++)
+      if (lin.owner[lin.pages[i].objs[j]] == i)
+        objs[obj_count++].obj_num = lin.pages[i].objs[j];
+  part8_start = obj_count;
+  for (i = 1; i < lin.page_count; i++)
+    for (j = 0; j < lin.pages[i].obj_count; j++)
+      if (lin.owner[lin.pages[i].objs[j]] == LIN_SHARED)
+        objs[obj_count++].obj_num = lin.pages[i].objs[j];
+  part9_start = obj_count;
+  for (def = pdf->defs; def; def = def->next)
+    if (lin.first_page[def->obj_num] == LIN_UNSEEN
+        && def != pdf->root)
+      objs[obj_count++].obj_num = def->obj_num;
+  rest_count = obj_count;
+  part6_count = lin.pages[0].obj_count;
+  for (j = 0; j < part6_count; j++)
+    objs[obj_count++].obj_num = lin.pages[0].objs[j];
+
+  /*
+   * Renumber. The rest are 1 to first_num - 1, then come the linearization
+   * dictionary, catalogue, hint stream and first page section.
+   */
+  obj_nums = xmalloc(pdf->next_obj_num * sizeof(int));
+  memset(obj_nums, 0, pdf->next_obj_num * sizeof(int));
+  first_num = rest_count + 1;
+  for (i = 0; i < rest_count; i++)
+    obj_nums[objs[i].obj_num] = i + 1;
+  obj_nums[pdf->root->obj_num] = first_num + 1;
+  for (i = rest_count; i < obj_count; i++)
+    obj_nums[objs[i].obj_num] = first_num + 3 + (i - rest_count);
+  first_count = 3 + part6_count;
+
+  for (i = 0; i < obj_count; i++) {
+    objs[i].obj = lin.defs[objs[i].obj_num]->obj;
+    objs[i].length = write_lin_obj(NULL, obj_nums, obj_nums[objs[i].obj_num],
+        objs[i].obj);
+    pdf_stats_count_obj(pdf, objs[i].obj_num, obj_nums[objs[i].obj_num],
+        objs[i].obj, objs[i].length);
+  }
+  catalogue.obj = pdf->root->obj;
+  catalogue.length = write_lin_obj(NULL, obj_nums, first_num + 1,
+      catalogue.obj);
+  pdf_stats_count_obj(pdf, pdf->root->obj_num, first_num + 1, catalogue.obj,
+      catalogue.length);
+
+  /* Lay out the file as if there were no hint stream. */
+  lin_bytes = format_lin_dict(first_num, 0, 0, 0, 0, 0, 0, 0, &lin_length);
+  free(lin_bytes);
+  first_xref_length = strlen("xref\n") + snprintf(NULL, 0, "%d %d\n", first_num,
+      first_count) + 20 * first_count + snprintf(NULL, 0, "trailer << /Size %d "
+      "/Root %d 0 R /Prev %-10ld >>\nstartxref\n0\n%%%%EOF\n",
+      first_num + first_count, first_num + 1, 0L);
+  offset = strlen("%PDF-1.7\n") + lin_length + first_xref_length;
+  catalogue.offset = offset;
+  offset += catalogue.length;
+  for (i = rest_count; i < obj_count; i++) {
+    objs[i].offset = offset;
+    offset += objs[i].length;
+  }
+  first_page_end = offset;
+  for (i = 0; i < rest_count; i++) {
+    objs[i].offset = offset;
+    offset += objs[i].length;
+  }
+
+  /* Page offset hint table. */
+  for (i = 1; i < lin.page_count; i++) {
+    page = &lin.pages[i];
+    for (j = 0; j < page->obj_count; j++)
+      if (lin.owner[page->objs[j]] == LIN_SHARED)
+        append_int(&page->shared, &page->shared_count, &page->shared_allocated,
+            page->objs[j]);
+  }
+  page_objs = xmalloc(lin.page_count * sizeof(int));
+  page_offsets = xmalloc(lin.page_count * sizeof(long));
+  page_lengths = xmalloc(lin.page_count * sizeof(long));
+  content_offsets = xmalloc(lin.page_count * sizeof(long));
+  content_lengths = xmalloc(lin.page_count * sizeof(long));
+  shared_index = xmalloc(pdf->next_obj_num * sizeof(int));
+  shared_count = 0;
+  for (i = rest_count; i < obj_count; i++)
+    shared_index[objs[i].obj_num] = shared_count++;
+  for (i = part8_start; i < part9_start; i++)
+    shared_index[objs[i].obj_num] = shared_count++;
+  for (i = 0, j = rest_count; i < lin.page_count; i++) {
+    page = &lin.pages[i];
+    if (i == 0) {
+      page_objs[i] = part6_count;
+      page_offsets[i] = objs[rest_count].offset;
+      page_lengths[i] = first_page_end - page_offsets[i];
+    } else {
+      for (j = 0; objs[j].obj_num != page->obj_num; j++);
+      page_objs[i] = 0;
+      for (k = 0; k < page->obj_count; k++)
+        if (lin.owner[page->objs[k]] == i)
+          page_objs[i]++;
+      page_offsets[i] = objs[j].offset;
+      page_lengths[i] = objs[j + page_objs[i] - 1].offset
+        + objs[j + page_objs[i] - 1].length - page_offsets[i];
+    }
+    content_offsets[i] = content_lengths[i] = 0;
+    contents = ref_get(lin.defs[page->obj_num]->obj, "Contents");
+    if (contents) {
+      for (k = 0; k < obj_count; k++)
+        if (objs[k].obj_num == contents)
+          break;
+      if (k < obj_count) {
+        content_offsets[i] = objs[k].offset - page_offsets[i];
+        content_lengths[i] = objs[k].length;
+      }
+    }
+  }
+  min_objs = max_objs = page_objs[0];
+  min_len = max_len = page_lengths[0];
+  min_coff = max_coff = content_offsets[0];
+  min_clen = max_clen = content_lengths[0];
+  max_shared = 0;
+  for (i = 0; i < lin.page_count; i++) {
+    if (page_objs[i] < min_objs) min_objs = page_objs[i];
+    if (page_objs[i] > max_objs) max_objs = page_objs[i];
+    if (page_lengths[i] < min_len) min_len = page_lengths[i];
+    if (page_lengths[i] > max_len) max_len = page_lengths[i];
+    if (content_offsets[i] < min_coff) min_coff = content_offsets[i];
+    if (content_offsets[i] > max_coff) max_coff = content_offsets[i];
+    if (content_lengths[i] < min_clen) min_clen = content_lengths[i];
+    if (content_lengths[i] > max_clen) max_clen = content_lengths[i];
+    if (i > 0 && lin.pages[i].shared_count > max_shared)
+      max_shared = lin.pages[i].shared_count;
+  }
+  bw.bytes = NULL;
+  bw.length = bw.allocated = 0;
+  bw.bit_count = 0;
+  put_bits(&bw, min_objs, 32);
+  put_bits(&bw, page_offsets[0], 32);
+  put_bits(&bw, bits_needed(max_objs - min_objs), 16);
+  put_bits(&bw, min_len, 32);
+  put_bits(&bw, bits_needed(max_len - min_len), 16);
+  put_bits(&bw, min_coff, 32);
+  put_bits(&bw, bits_needed(max_coff - min_coff), 16);
+  put_bits(&bw, min_clen, 32);
+  put_bits(&bw, bits_needed(max_clen - min_clen), 16);
+  put_bits(&bw, bits_needed(max_shared), 16);
+  put_bits(&bw, bits_needed(shared_count), 16);
+  put_bits(&bw, 0, 16);
+  put_bits(&bw, 4, 16);
+  for (i = 0; i < lin.page_count; i++)
+    put_bits(&bw, page_objs[i] - min_objs, bits_needed(max_objs - min_objs));
+  flush_bits(&bw);
+  for (i = 0; i < lin.page_count; i++)
+    put_bits(&bw, page_lengths[i] - min_len, bits_needed(max_len - min_len));
+  flush_bits(&bw);
+  /* The first page's shared objects are all in its own section. */
+  for (i = 0; i < lin.page_count; i++)
+    put_bits(&bw, i ? lin.pages[i].shared_count : 0, bits_needed(max_shared));
+  flush_bits(&bw);
+  for (i = 1; i < lin.page_count; i++)
+    for (j = 0; j < lin.pages[i].shared_count; j++)
+      put_bits(&bw, shared_index[lin.pages[i].shared[j]], bits_needed(shared_count));
+  flush_bits(&bw);
+  for (i = 0; i < lin.page_count; i++)
+    put_bits(&bw, content_offsets[i] - min_coff, bits_needed(max_coff - min_coff));
+  flush_bits(&bw);
+  for (i = 0; i < lin.page_count; i++)
+    put_bits(&bw, content_lengths[i] - min_clen, bits_needed(max_clen - min_clen));
+  flush_bits(&bw);
+
+  /* Shared object hint table, one object per group. */
+  shared_table_offset = bw.length;
+  min_len = max_len = objs[rest_count].length;
+  for (i = 0; i < obj_count; i++) {
+    if (i >= part9_start && i < rest_count)
+      continue;
+    if (i < part8_start)
+      continue;
+    if (objs[i].length < min_len) min_len = objs[i].length;
+    if (objs[i].length > max_len) max_len = objs[i].length;
+  }
+  put_bits(&bw, part9_start > part8_start ? obj_nums[objs[part8_start].obj_num] : 0, 32);
+  put_bits(&bw, part9_start > part8_start ? objs[part8_start].offset : 0, 32);
+  put_bits(&bw, part6_count, 32);
+  put_bits(&bw, shared_count, 32);
+  put_bits(&bw, 0, 16);
+  put_bits(&bw, min_len, 32);
+  put_bits(&bw, bits_needed(max_len - min_len), 16);
+  for (i = rest_count; i < obj_count; i++)
+    put_bits(&bw, objs[i].length - min_len, bits_needed(max_len - min_len));
+  for (i = part8_start; i < part9_start; i++)
+    put_bits(&bw, objs[i].length - min_len, bits_needed(max_len - min_len));
+  flush_bits(&bw);
+  for (i = 0; i < shared_count; i++)
+    put_bits(&bw, 0, 1);
+  flush_bits(&bw);
+
+  hint_dict = pdf_create_dictionary(pdf);
+  hint_dict = pdf_prepend_dictionary(pdf, hint_dict, "S",
+      (struct pdf_obj *)pdf_create_integer(pdf, shared_table_offset));
+  hint.obj = (struct pdf_obj *)pdf_create_stream(pdf, hint_dict,
+      pdf_create_array(pdf), bw.length, (char *)bw.bytes);
+  hint.length = write_lin_obj(NULL, obj_nums, first_num + 2, hint.obj);
+
+  /* Now place the hint stream after the catalogue. */
+  hint_offset = catalogue.offset + catalogue.length;
+  for (i = 0; i < obj_count; i++)
+    objs[i].offset += hint.length;
+  first_page_end += hint.length;
+  main_xref_offset = offset + hint.length;
+
+  xref = open_memstream(&main_xref, &main_xref_length);
+  fprintf(xref, "xref\n0 %d\n", first_num);
+  fprintf(xref, "0000000000 65535 f \n");
+  for (i = 0; i < rest_count; i++)
+    fprintf(xref, "%010ld 00000 n \n", objs[i].offset);
+  fprintf(xref, "trailer << /Size %d >>\n", first_num);
+  first_xref_offset = strlen("%PDF-1.7\n") + lin_length;
+  fprintf(xref, "startxref\n%ld\n%%%%EOF", first_xref_offset);
+  fclose(xref);
+  file_length = main_xref_offset + main_xref_length;
+
+  lin_bytes = format_lin_dict(first_num, file_length, hint_offset, hint.length,
+      obj_nums[lin.pages[0].obj_num], first_page_end, lin.page_count,
+      main_xref_offset + snprintf(NULL, 0, "xref\n0 %d\n", first_num) - 1,
+      &lin_length);
+
+  xref = open_memstream(&first_xref, &first_xref_length);
+  fprintf(xref, "xref\n%d %d\n", first_num, first_count);
+  fprintf(xref, "%010ld 00000 n \n", (long)strlen("%PDF-1.7\n"));
+  fprintf(xref, "%010ld 00000 n \n", catalogue.offset);
+  fprintf(xref, "%010ld 00000 n \n", hint_offset);
+  for (i = rest_count; i < obj_count; i++)
+    fprintf(xref, "%010ld 00000 n \n", objs[i].offset);
+  fprintf(xref, "trailer << /Size %d /Root %d 0 R /Prev %-10ld >>\n"
+      "startxref\n0\n%%%%EOF\n", first_num + first_count, first_num + 1,
+      main_xref_offset);
+  fclose(xref);
+
+  pdf_stats_count(pdf, PDF_KIND_XREF, lin_length);
+  pdf_stats_count(pdf, PDF_KIND_XREF, first_xref_length);
+  pdf_stats_count(pdf, PDF_KIND_XREF, hint.length);
+  pdf_stats_count(pdf, PDF_KIND_XREF, main_xref_length);
+  if (pdf->stats)
+    pdf->stats->file_bytes = file_length;
+
+  fprintf(file, "%%PDF-1.7\n");
+  fwrite(lin_bytes, 1, lin_length, file);
+  fwrite(first_xref, 1, first_xref_length, file);
+  /* The objects are written again rather than kept, spilled streams too. */
+  write_lin_obj(file, obj_nums, first_num + 1, catalogue.obj);
+  write_lin_obj(file, obj_nums, first_num + 2, hint.obj);
+  for (i = rest_count; i < obj_count; i++)
+    write_lin_obj(file, obj_nums, obj_nums[objs[i].obj_num], objs[i].obj);
+  for (i = 0; i < rest_count; i++)
+    write_lin_obj(file, obj_nums, obj_nums[objs[i].obj_num], objs[i].obj);
+  fwrite(main_xref, 1, main_xref_length, file);
+
+  for (i = 0; i < lin.page_count; i++) {
+    free(lin.pages[i].objs);
+    free(lin.pages[i].shared);
+  }
+  free(lin_bytes);
+  free(first_xref);
+  free(main_xref);
+  free(objs);
+  free(obj_nums);
+  free(shared_index);
+  free(page_objs);
+  free(page_offsets);
+  free(page_lengths);
+  free(content_offsets);
+  free(content_lengths);
+  free(lin.pages);
+  free(lin.defs);
+  free(lin.owner);
+  free(lin.first_page);
+  free(lin.stamp);
+}
+
+/*
+ * Append the objects as an incremental update to the base file, which file
+ * is positioned at the end of. Only the defined objects get cross-reference
+ * entries, in runs of consecutive object numbers.
+ */
+static void
+write_update(struct pdf *pdf, FILE *file)
+{
+  struct pdf_writer w;
   struct pdf_indirect_obj_def *def;
   long *xref_obj_offsets;
   long xref_offset;
-  int i;
-  if (pdf->root == NULL) {
-    fprintf(stderr, "twpdf: Cant write pdf without a root.\n");
-    exit(1);
+  int i, end;
+  w.file = file;
+  w.obj_nums = NULL;
+  w.offset = pdf->base->length;
+  /* The base may end straight after its %%EOF. */
+  put_format(&w, "\n");
+  xref_obj_offsets = xmalloc(pdf->next_obj_num * sizeof(long));
+  memset(xref_obj_offsets, 0, pdf->next_obj_num * sizeof(long));
+  for (def = pdf->defs; def; def = def->next) {
+    if (def->obj_num >= pdf->next_obj_num)
+      tw_fail(TW_ERR_INVALID, "twpdf: Unexpected object number in definition.");
+    xref_obj_offsets[def->obj_num] = w.offset;
+    put_format(&w, "%d 0 obj\n", def->obj_num);
+    write_obj(&w, def->obj);
+    put_format(&w, "\nendobj\n");
+    pdf_stats_count_obj(pdf, def->obj_num, def->obj_num, def->obj,
+        w.offset - xref_obj_offsets[def->obj_num]);
   }
-  file = fopen(fname, "w");
-  if (file == NULL) {
-    fprintf(stderr, "twpdf: Failed to open file %s.\n", fname);
-    exit(1);
+  xref_offset = w.offset;
+  put_format(&w, "xref\n");
+  for (i = 1; i < pdf->next_obj_num; i = end) {
+    for (end = i; end < pdf->next_obj_num && xref_obj_offsets[end]; end++)
+      ;
+    if (end == i) {
+      end++;
+      continue;
+    }
+    put_format(&w, "%d %d\n", i, end - i);
+    for (; i < end; i++)
+      put_format(&w, "%010ld 00000 n \n", xref_obj_offsets[i]);
   }
+  put_format(&w, "trailer << /Size %d /Root %d 0 R /Prev %ld >>\n",
+      pdf->next_obj_num, pdf->base->root_obj_num, pdf->base->xref_offset);
+  put_format(&w, "startxref\n");
+  put_format(&w, "%ld\n", xref_offset);
+  put_format(&w, "%%%%EOF");
+  pdf_stats_count(pdf, PDF_KIND_XREF, w.offset - xref_offset);
+  if (pdf->stats)
+    pdf->stats->file_bytes = w.offset;
+  free(xref_obj_offsets);
+}
+
+void
+pdf_write_file(struct pdf *pdf, FILE *file)
+{
+  struct pdf_writer w;
+  struct pdf_indirect_obj_def *def;
+  long *xref_obj_offsets;
+  if (pdf->base) {
+    write_update(pdf, file);
+    return;
+  }
+  if (pdf->root == NULL)
+    tw_fail(TW_ERR_INVALID, "twpdf: Cant write pdf without a root.");
+  if (pdf->linearize) {
+    write_linearized(pdf, file);
+    return;
+  }
+  w.file = file;
+  w.obj_nums = NULL;
+  w.offset = 0;
   /* Header */
-  fprintf(file, "%%PDF-1.7\n");
+  put_format(&w, "%%PDF-1.7\n");
   /* Body */
   xref_obj_offsets = xmalloc(pdf->next_obj_num * sizeof(long));
   memset(xref_obj_offsets, 0, pdf->next_obj_num * sizeof(long));
   for (def = pdf->defs; def; def = def->next) {
-    if (def->obj_num > pdf->next_obj_num) {
-      fprintf(stderr, "twpdf: Unexpected object number in definition.\n");
-      exit(1);
-    }
-    xref_obj_offsets[def->obj_num] = ftell(file);
-    fprintf(file, "%d 0 obj\n", def->obj_num);
-    write_obj(file, def->obj);
-    fprintf(file, "\nendobj\n");
+    if (def->obj_num > pdf->next_obj_num)
+      tw_fail(TW_ERR_INVALID, "twpdf: Unexpected object number in definition.");
+    xref_obj_offsets[def->obj_num] = w.offset;
+    put_format(&w, "%d 0 obj\n", def->obj_num);
+    write_obj(&w, def->obj);
+    put_format(&w, "\nendobj\n");
+    pdf_stats_count_obj(pdf, def->obj_num, def->obj_num, def->obj,
+        w.offset - xref_obj_offsets[def->obj_num]);
   }
+  write_xref(&w, pdf, xref_obj_offsets);
+  free(xref_obj_offsets);
+}
+
+/* The cross-reference table and trailer, for objects without an offset free. */
+static void
+write_xref(struct pdf_writer *w, struct pdf *pdf, const long *obj_offsets)
+{
+  long xref_offset;
+  int i, obj_count;
+  obj_count = pdf->next_obj_num;
   /* Cross-Reference Table */
-  xref_offset = ftell(file);
-  fprintf(file, "xref\n");
-  fprintf(file, "0 %d\n", pdf->next_obj_num);
-  fprintf(file, "0000000000 65535 f \n");
-  for (i = 1; i < pdf->next_obj_num; i++)
-    fprintf(file, "%010ld 00000 %c \n", xref_obj_offsets[i],
-        xref_obj_offsets[i] ? 'n' : 'f');
+  xref_offset = w->offset;
+  put_format(w, "xref\n");
+  put_format(w, "0 %d\n", obj_count);
+  put_format(w, "0000000000 65535 f \n");
+  for (i = 1; i < obj_count; i++)
+    put_format(w, "%010ld 00000 %c \n", obj_offsets[i],
+        obj_offsets[i] ? 'n' : 'f');
   /* Trailer */
-  fprintf(file, "trailer << /Size %d /Root %d 0 R >>\n", pdf->next_obj_num,
+  put_format(w, "trailer << /Size %d /Root %d 0 R >>\n", obj_count,
       pdf->root->obj_num);
-  fprintf(file, "startxref\n");
-  fprintf(file, "%ld\n", xref_offset);
-  fprintf(file, "%%%%EOF");
+  put_format(w, "startxref\n");
+  put_format(w, "%ld\n", xref_offset);
+  put_format(w, "%%%%EOF");
+  pdf_stats_count(pdf, PDF_KIND_XREF, w->offset - xref_offset);
+  if (pdf->stats)
+    pdf->stats->file_bytes = w->offset;
+}
 
-  if (ferror(file)) {
-    fprintf(stderr, "twpdf: Error writing file %s.\n", fname);
-    exit(1);
+/* Make room for the offsets of objects numbered below obj_count. */
+static void
+grow_obj_offsets(struct pdf_output *out, int obj_count)
+{
+  int allocated;
+  if (obj_count <= out->obj_allocated)
+    return;
+  allocated = out->obj_allocated ? out->obj_allocated : 64;
+  while (allocated < obj_count)
+    allocated *= 2;
+  out->obj_offsets = xrealloc(out->obj_offsets, allocated * sizeof(long));
+  memset(out->obj_offsets + out->obj_allocated, 0,
+      (allocated - out->obj_allocated) * sizeof(long));
+  out->obj_allocated = allocated;
+}
+
+void
+pdf_output_begin(struct pdf_output *out, FILE *file)
+{
+  struct pdf_writer w;
+  w.file = file;
+  w.offset = 0;
+  w.obj_nums = NULL;
+  put_format(&w, "%%PDF-1.7\n");
+  out->file = file;
+  out->offset = w.offset;
+  out->obj_allocated = 0;
+  out->obj_offsets = NULL;
+  out->flushed = NULL;
+  out->target = NULL;
+}
+
+/*
+ * Write the objects defined since the last flush, in the order they were
+ * defined. Their objects must not change afterwards.
+ */
+void
+pdf_output_flush(struct pdf_output *out, struct pdf *pdf)
+{
+  struct pdf_writer w;
+  struct pdf_indirect_obj_def *def, **defs;
+  int count;
+  grow_obj_offsets(out, pdf->next_obj_num);
+  count = 0;
+  for (def = pdf->defs; def != out->flushed; def = def->next)
+    count++;
+  defs = xmalloc(count * sizeof(struct pdf_indirect_obj_def *));
+  count = 0;
+  for (def = pdf->defs; def != out->flushed; def = def->next)
+    defs[count++] = def;
+  w.file = out->file;
+  w.offset = out->offset;
+  w.obj_nums = NULL;
+  while (count--) {
+    def = defs[count];
+    out->obj_offsets[def->obj_num] = w.offset;
+    put_format(&w, "%d 0 obj\n", def->obj_num);
+    write_obj(&w, def->obj);
+    put_format(&w, "\nendobj\n");
+    pdf_stats_count_obj(pdf, def->obj_num, def->obj_num, def->obj,
+        w.offset - out->obj_offsets[def->obj_num]);
   }
+  free(defs);
+  out->offset = w.offset;
+  out->flushed = pdf->defs;
+}
 
-  free(xref_obj_offsets);
+/*
+ * Write every object of pdf defined from now on straight away rather than
+ * keeping it, so flushing isn't needed. Streams and templates are freed as
+ * soon as they are written, and only the offsets are kept, so the pdf holds
+ * little more than the page tree. Nothing may be defined before, and the pdf
+ * can't be linearized or update a base file.
+ */
+void
+pdf_output_immediate(struct pdf_output *out, struct pdf *pdf)
+{
+  if (pdf->linearize || pdf->base || pdf->defs)
+    tw_fail(TW_ERR_INVALID, "twpdf: Cant write this pdf immediately.");
+  pdf->output = out;
+}
+
+/* Write one object at the end of the output, see pdf_output_immediate. */
+void
+pdf_output_obj(struct pdf_output *out, struct pdf *pdf, int obj_num,
+    const struct pdf_obj *obj)
+{
+  struct pdf_writer w;
+  grow_obj_offsets(out, pdf->next_obj_num);
+  w.file = out->file;
+  w.offset = out->offset;
+  w.obj_nums = NULL;
+  out->obj_offsets[obj_num] = w.offset;
+  put_format(&w, "%d 0 obj\n", obj_num);
+  write_obj(&w, obj);
+  put_format(&w, "\nendobj\n");
+  pdf_stats_count_obj(pdf, obj_num, obj_num, obj,
+      w.offset - out->obj_offsets[obj_num]);
+  out->offset = w.offset;
+}
+
+/* Write the remaining objects and the cross-reference table. */
+void
+pdf_output_end(struct pdf_output *out, struct pdf *pdf)
+{
+  struct pdf_writer w;
+  if (pdf->root == NULL)
+    tw_fail(TW_ERR_INVALID, "twpdf: Cant write pdf without a root.");
+  pdf_output_flush(out, pdf);
+  pdf->output = NULL;
+  w.file = out->file;
+  w.offset = out->offset;
+  w.obj_nums = NULL;
+  write_xref(&w, pdf, out->obj_offsets);
+  free(out->obj_offsets);
+}
+
+/*
+ * Hold what is written from now on in memory, until it is committed to the
+ * file or discarded.
+ */
+void
+pdf_output_stage(struct pdf_output *out)
+{
+  out->target = out->file;
+  out->stage_offset = out->offset;
+  out->file = open_memstream(&out->staged, &out->staged_length);
+  if (out->file == NULL) {
+    out->file = out->target;
+    tw_fail(TW_ERR_MEMORY, "twpdf: Failed to open memory stream.");
+  }
+}
+
+void
+pdf_output_commit(struct pdf_output *out)
+{
+  fclose(out->file);
+  out->file = out->target;
+  fwrite(out->staged, 1, out->staged_length, out->file);
+  free(out->staged);
+}
+
+/*
+ * Drop what was staged, as if the objects numbered obj_num and above had
+ * never been defined. Nothing that was kept may refer to them.
+ */
+void
+pdf_output_discard(struct pdf_output *out, struct pdf *pdf, int obj_num)
+{
+  int i;
+  fclose(out->file);
+  out->file = out->target;
+  free(out->staged);
+  out->offset = out->stage_offset;
+  for (i = obj_num; i < out->obj_allocated && i < pdf->next_obj_num; i++)
+    out->obj_offsets[i] = 0;
+  pdf->next_obj_num = obj_num;
+}
+
+/* The number of bytes obj takes when written as a direct object. */
+long
+pdf_obj_length(const struct pdf_obj *obj)
+{
+  struct pdf_writer w;
+  w.obj_nums = NULL;
+  w.file = NULL;
+  w.offset = 0;
+  write_obj(&w, obj);
+  return w.offset;
+}
+
+/*
+ * At most how many bytes the cross-reference table and trailer take for
+ * obj_count objects. Each object has a 20 byte entry, and the rest is under
+ * 128 bytes for any offset.
+ */
+long
+pdf_xref_bound(int obj_count)
+{
+  return 20L * obj_count + 128;
+}
+
+void
+pdf_write(struct pdf *pdf, const char *fname)
+{
+  struct tw_trap trap;
+  FILE *file;
+  if (strcmp(fname, "-") == 0) {
+    if (pdf->base)
+      tw_fail(TW_ERR_INVALID, "twpdf: Cant append to standard output.");
+    pdf_write_file(pdf, stdout);
+    if (fflush(stdout) || ferror(stdout))
+      tw_fail(TW_ERR_IO, "twpdf: Error writing to standard output.");
+    return;
+  }
+  /* An update is appended to the base file, which is never rewritten. */
+  file = fopen(fname, pdf->base ? "a" : "w");
+  if (file == NULL)
+    tw_fail(TW_ERR_IO, "twpdf: Failed to open file %s.", fname);
+  tw_push_trap(&trap);
+  if (setjmp(trap.env)) {
+    fclose(file);
+    tw_rethrow(&trap);
+  }
+  if (pdf->base) {
+    fseek(file, 0, SEEK_END);
+    if (ftell(file) != pdf->base->length)
+      tw_fail(TW_ERR_IO, "twpdf: File %s changed while appending.", fname);
+  }
+  pdf_write_file(pdf, file);
+  if (ferror(file))
+    tw_fail(TW_ERR_IO, "twpdf: Error writing file %s.", fname);
+  tw_pop_trap(&trap);
   fclose(file);
 }
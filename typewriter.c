@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2023 Christopher Lang
+ * See LICENSE for license details.
+ */
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "twpdf.h"
+#include "document.h"
+#include "stralloc.h"
+#include "winansi.h"
+#include "typewriter.h"
+#include "twerror.h"
+
+/*
+ * Text and image names are copied, so callers can reuse their buffers as
+ * soon as a call returns.
+ */
+struct tw_document {
+  struct document doc;
+  struct stralloc stralloc;
+  int laid_out;
+  char message[TW_MESSAGE_MAX];
+};
+
+static int caught(struct tw_document *tw, struct tw_trap *trap);
+static int check_unlaid(struct tw_document *tw);
+
+static int
+caught(struct tw_document *tw, struct tw_trap *trap)
+{
+  strcpy(tw->message, trap->message);
+  return trap->code;
+}
+
+static int
+check_unlaid(struct tw_document *tw)
+{
+  if (!tw->laid_out)
+    return TW_OK;
+  strcpy(tw->message, "Document already laid out.");
+  return TW_ERR_INVALID;
+}
+
+void
+tw_default_options(struct tw_options *opts)
+{
+  opts->top_margin = 40;
+  opts->bot_margin = 40;
+  opts->left_margin = 80;
+  opts->linearize = 0;
+  opts->ascii85 = 0;
+  opts->memory_budget = 0;
+}
+
+/* Returns NULL if there is not enough memory. */
+struct tw_document *
+tw_create(const struct tw_options *opts)
+{
+  struct tw_document *volatile tw;
+  struct tw_trap trap;
+  tw = NULL;
+  tw_push_trap(&trap);
+  if (setjmp(trap.env)) {
+    free(tw);
+    return NULL;
+  }
+  tw = xmalloc(sizeof(struct tw_document));
+  init_document(&tw->doc, opts->top_margin, opts->bot_margin,
+      opts->left_margin);
+  tw->doc.pdf.linearize = opts->linearize;
+  tw->doc.pdf.ascii85 = opts->ascii85;
+  tw->doc.pdf.memory_budget = opts->memory_budget;
+  stralloc_init(&tw->stralloc);
+  tw_pop_trap(&trap);
+  tw->laid_out = 0;
+  tw->message[0] = '\0';
+  return tw;
+}
+
+void
+tw_free(struct tw_document *tw)
+{
+  free_document(&tw->doc);
+  stralloc_free(&tw->stralloc);
+  free(tw);
+}
+
+/* The message of the last failure, empty if nothing has failed. */
+const char *
+tw_error_message(const struct tw_document *tw)
+{
+  return tw->message;
+}
+
+/* Add one line of UTF-8 text, shown in WinAnsiEncoding. */
+int
+tw_add_text(struct tw_document *tw, const char *str, int length,
+    int font_size)
+{
+  struct tw_trap trap;
+  char *copy;
+  if (check_unlaid(tw))
+    return TW_ERR_INVALID;
+  tw_push_trap(&trap);
+  if (setjmp(trap.env))
+    return caught(tw, &trap);
+  copy = stralloc_copy(&tw->stralloc, str, length);
+  length = winansi_from_utf8(copy, length);
+  put_text(&tw->doc, copy, length, font_size);
+  tw_pop_trap(&trap);
+  return TW_OK;
+}
+
+/* Add a JPEG image scaled to width, keeping its aspect ratio. */
+int
+tw_add_image(struct tw_document *tw, const char *fname, int width)
+{
+  struct tw_trap trap;
+  if (check_unlaid(tw))
+    return TW_ERR_INVALID;
+  tw_push_trap(&trap);
+  if (setjmp(trap.env))
+    return caught(tw, &trap);
+  put_image(&tw->doc, stralloc_alloc(&tw->stralloc, fname), width);
+  tw_pop_trap(&trap);
+  return TW_OK;
+}
+
+/*
+ * Add a place where a page may break at the cost of break_penalty, or else
+ * leave no_break_height of space.
+ */
+int
+tw_add_glue(struct tw_document *tw, int break_penalty, int no_break_height)
+{
+  struct tw_trap trap;
+  if (check_unlaid(tw))
+    return TW_ERR_INVALID;
+  tw_push_trap(&trap);
+  if (setjmp(trap.env))
+    return caught(tw, &trap);
+  put_glue(&tw->doc, break_penalty, no_break_height);
+  tw_pop_trap(&trap);
+  return TW_OK;
+}
+
+/* Choose the page breaks and build the pages. Nothing can be added after. */
+int
+tw_layout(struct tw_document *tw)
+{
+  struct tw_trap trap;
+  if (check_unlaid(tw))
+    return TW_ERR_INVALID;
+  tw->laid_out = 1;
+  tw_push_trap(&trap);
+  if (setjmp(trap.env))
+    return caught(tw, &trap);
+  optimise_breaks(&tw->doc);
+  build_document(&tw->doc);
+  tw_pop_trap(&trap);
+  return TW_OK;
+}
+
+/* Write the PDF to fname, "-" for standard output, laying it out if needed. */
+int
+tw_write(struct tw_document *tw, const char *fname)
+{
+  struct tw_trap trap;
+  int err;
+  if (!tw->laid_out && (err = tw_layout(tw)))
+    return err;
+  tw_push_trap(&trap);
+  if (setjmp(trap.env))
+    return caught(tw, &trap);
+  pdf_write(&tw->doc.pdf, fname);
+  tw_pop_trap(&trap);
+  return TW_OK;
+}
+
+/* The PDF in memory, which the caller frees. */
+int
+tw_write_memory(struct tw_document *tw, char **bytes, long *length)
+{
+  struct pdf_sink sink;
+  struct tw_trap trap;
+  int err;
+  if (!tw->laid_out && (err = tw_layout(tw)))
+    return err;
+  tw_push_trap(&trap);
+  if (setjmp(trap.env))
+    return caught(tw, &trap);
+  pdf_sink_memory(&sink);
+  pdf_write_sink(&tw->doc.pdf, &sink);
+  tw_pop_trap(&trap);
+  *bytes = sink.bytes;
+  *length = sink.length;
+  return TW_OK;
+}
+
+/* Write to fd, which is left open. */
+int
+tw_write_fd(struct tw_document *tw, int fd)
+{
+  struct pdf_sink sink;
+  struct tw_trap trap;
+  int err;
+  if (!tw->laid_out && (err = tw_layout(tw)))
+    return err;
+  tw_push_trap(&trap);
+  if (setjmp(trap.env))
+    return caught(tw, &trap);
+  pdf_sink_fd(&sink, fd);
+  pdf_write_sink(&tw->doc.pdf, &sink);
+  tw_pop_trap(&trap);
+  return TW_OK;
+}
+
+/*
+ * Pass the PDF to write a piece at a time, in order. write returns nonzero
+ * to stop, which fails with TW_ERR_IO.
+ */
+int
+tw_write_callback(struct tw_document *tw,
+    int (*write)(void *arg, const char *bytes, long length), void *arg)
+{
+  struct pdf_sink sink;
+  struct tw_trap trap;
+  int err;
+  if (!tw->laid_out && (err = tw_layout(tw)))
+    return err;
+  tw_push_trap(&trap);
+  if (setjmp(trap.env))
+    return caught(tw, &trap);
+  pdf_sink_callback(&sink, write, arg);
+  pdf_write_sink(&tw->doc.pdf, &sink);
+  tw_pop_trap(&trap);
+  return TW_OK;
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2023 Christopher Lang
+ * See LICENSE for license details.
+ */
+
+/*
+ * The interface of libtypewriter, for rendering PDFs inside another program.
+ * A document is built from text lines, images and glue, then laid out and
+ * written. Documents share nothing, so different threads may work on
+ * different documents at once.
+ *
+ * Functions that can fail return one of the codes below, TW_OK on success,
+ * and keep a message for tw_error_message. A document that failed to lay
+ * out or write can only be freed.
+ */
+
+enum tw_error {
+  TW_OK,
+  TW_ERR_MEMORY,        /* An allocation failed. */
+  TW_ERR_IO,            /* A file could not be opened, read or written. */
+  TW_ERR_JPEG,          /* An image is not a JPEG that can be embedded. */
+  TW_ERR_PDF,           /* A PDF to append to could not be read. */
+  TW_ERR_INVALID,       /* The library was used in a way it does not allow. */
+};
+
+struct tw_options {
+  int top_margin, bot_margin, left_margin;
+  int linearize;
+  int ascii85;          /* Encode streams with ASCII85 rather than hex. */
+  long memory_budget;   /* Stream bytes kept in memory, 0 for no limit. */
+};
+
+struct tw_document;
+
+void tw_default_options(struct tw_options *opts);
+struct tw_document *tw_create(const struct tw_options *opts);
+void tw_free(struct tw_document *tw);
+const char *tw_error_message(const struct tw_document *tw);
+int tw_add_text(struct tw_document *tw, const char *str, int length,
+    int font_size);
+int tw_add_image(struct tw_document *tw, const char *fname, int width);
+int tw_add_glue(struct tw_document *tw, int break_penalty,
+    int no_break_height);
+int tw_layout(struct tw_document *tw);
+int tw_write(struct tw_document *tw, const char *fname);
+int tw_write_memory(struct tw_document *tw, char **bytes, long *length);
+int tw_write_fd(struct tw_document *tw, int fd);
+int tw_write_callback(struct tw_document *tw,
+    int (*write)(void *arg, const char *bytes, long length), void *arg);
@@ -3,26 +3,29 @@
  * See LICENSE for license details.
  */
 
+#include <setjmp.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
 
 #include "utils.h"
+#include "typewriter.h"
+#include "twerror.h"
 
 void *
 xmalloc(size_t len)
 {
   void *p;
-  if ( (p = malloc(len)) == NULL)
-    perror("malloc");
+  if ( (p = malloc(len)) == NULL && len)
+    tw_fail(TW_ERR_MEMORY, "malloc: Out of memory.");
   return p;
 }
 
 void *
 xrealloc(void *p, size_t len)
 {
-  if ( (p = realloc(p, len)) == NULL)
-    perror("realloc");
+  if ( (p = realloc(p, len)) == NULL && len)
+    tw_fail(TW_ERR_MEMORY, "realloc: Out of memory.");
   return p;
 }
 
@@ -34,7 +37,9 @@ revsprintf(char **stream, long *allocated, long *length, const char *format, va_
   va_copy(args_copy, args);
   written = vsnprintf(*stream + *length, *allocated - *length, format, args);
   if (written >= *allocated - *length) {
-    *allocated += written + 1024 * 4;
+    *allocated *= 2;
+    if (*allocated <= *length + written)
+      *allocated = *length + written + 1;
     *stream = xrealloc(*stream, *allocated);
     vsprintf(*stream + *length, format, args_copy);
   }
@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2023 Christopher Lang
+ * See LICENSE for license details.
+ */
+
+/*
+ * Text is shown with the standard fonts in WinAnsiEncoding, Windows code page
+ * 1252, which is Latin-1 with printable characters in 0x80 to 0x9f.
+ */
+
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "winansi.h"
+
+static int ascii_length(const char *bytes, int length);
+static int decode_utf8(const unsigned char *bytes, int length, long *code);
+static int encode_winansi(long code);
+
+/* Unicode code points of 0x80 to 0x9f, 0 where the code is unused. */
+static const unsigned short winansi_high[32] = {
+  0x20ac, 0, 0x201a, 0x0192, 0x201e, 0x2026, 0x2020, 0x2021,
+  0x02c6, 0x2030, 0x0160, 0x2039, 0x0152, 0, 0x017d, 0,
+  0, 0x2018, 0x2019, 0x201c, 0x201d, 0x2022, 0x2013, 0x2014,
+  0x02dc, 0x2122, 0x0161, 0x203a, 0x0153, 0, 0x017e, 0x0178,
+};
+
+/* The number of ASCII bytes bytes starts with, 16 at a time with SSE2. */
+static int
+ascii_length(const char *bytes, int length)
+{
+  int i;
+  i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= length; i += 16)
+    if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(bytes + i))))
+      break;
+#endif
+  while (i < length && !(bytes[i] & 0x80))
+    i++;
+  return i;
+}
+
+/*
+ * Decode the UTF-8 sequence bytes starts with. Returns its length, or 0 if
+ * it isn't well formed.
+ */
+static int
+decode_utf8(const unsigned char *bytes, int length, long *code)
+{
+  int n, i;
+  long min;
+  if (bytes[0] >= 0xc2 && bytes[0] <= 0xdf) {
+    n = 2;
+    *code = bytes[0] & 0x1f;
+    min = 0x80;
+  } else if (bytes[0] >= 0xe0 && bytes[0] <= 0xef) {
+    n = 3;
+    *code = bytes[0] & 0x0f;
+    min = 0x800;
+  } else if (bytes[0] >= 0xf0 && bytes[0] <= 0xf4) {
+    n = 4;
+    *code = bytes[0] & 0x07;
+    min = 0x10000;
+  } else {
+    return 0;
+  }
+  if (n > length)
+    return 0;
+  for (i = 1; i < n; i++) {
+    if ((bytes[i] & 0xc0) != 0x80)
+      return 0;
+    *code = *code << 6 | (bytes[i] & 0x3f);
+  }
+  if (*code < min || *code > 0x10ffff || (*code >= 0xd800 && *code <= 0xdfff))
+    return 0;
+  return n;
+}
+
+/* Returns '?' for characters WinAnsiEncoding lacks. */
+static int
+encode_winansi(long code)
+{
+  int i;
+  if (code >= 0xa0 && code <= 0xff)
+    return code;
+  for (i = 0; i < 32; i++)
+    if (winansi_high[i] == code)
+      return 0x80 + i;
+  return '?';
+}
+
+/*
+ * Transcode UTF-8 to WinAnsiEncoding in place, returning the new length.
+ * Bytes that aren't part of a well formed sequence are kept as they are, so
+ * Latin-1 and code page 1252 text comes through unchanged.
+ */
+int
+winansi_from_utf8(char *bytes, int length)
+{
+  const unsigned char *in;
+  long code;
+  int i, out, n;
+  i = out = ascii_length(bytes, length);
+  while (i < length) {
+    in = (const unsigned char *)bytes + i;
+    if ( (n = decode_utf8(in, length - i, &code)) ) {
+      bytes[out++] = encode_winansi(code);
+      i += n;
+    } else {
+      bytes[out++] = *in;
+      i++;
+    }
+    n = ascii_length(bytes + i, length - i);
+    memmove(bytes + out, bytes + i, n);
+    out += n;
+    i += n;
+  }
+  return out;
+}
@@ -0,0 +1,6 @@
+/*
+ * Copyright (C) 2023 Christopher Lang
+ * See LICENSE for license details.
+ */
+
+int winansi_from_utf8(char *bytes, int length);